@@ -0,0 +1,152 @@
+#ifndef MEMORY_VISITOR_H
+#define MEMORY_VISITOR_H
+
+// Scene memory accounting shared by the labs. getMemoryUsage() tallies the
+// cpu memory of a subgraph and, given a context id, what the subgraph has
+// allocated on the gpu in that context.
+
+#include <osg/NodeVisitor>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/Texture>
+#include <osg/BufferObject>
+
+#include <set>
+
+#define STATE_ENTRY_BYTES 64 //rough size of one state attribute, mode or uniform
+
+//memory used by a subgraph, objects shared by several nodes are counted once
+struct MemoryUsage
+{
+  size_t nodeBytes = 0;       //nodes and drawables themselves
+  size_t geometryBytes = 0;   //vertex arrays and primitive indices
+  size_t textureBytes = 0;    //images including mipmaps
+  size_t stateSetBytes = 0;
+  size_t gpuBufferBytes = 0;  //buffer objects and display lists in one context
+  size_t gpuTextureBytes = 0; //texture objects in one context
+  unsigned int nodes = 0;
+  unsigned int geometries = 0;
+  unsigned int textures = 0;
+  unsigned int stateSets = 0;
+
+  size_t cpuBytes() const { return nodeBytes + geometryBytes + textureBytes + stateSetBytes; }
+  size_t gpuBytes() const { return gpuBufferBytes + gpuTextureBytes; }
+};
+
+//tallies the memory of a subgraph, the gpu side only when a context id is given
+class MemoryVisitor : public osg::NodeVisitor
+{
+public:
+  MemoryVisitor(int contextID) : osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN), contextID(contextID) {}
+
+  virtual void apply(osg::Node & node)
+  {
+    //shared subgraphs are only counted the first time
+    if( !counted.insert(&node).second ) return;
+    usage.nodes++;
+    usage.nodeBytes += sizeof(osg::Group);
+    countStateSet( node.getStateSet() );
+    traverse(node);
+  }
+
+  virtual void apply(osg::Geode & geode)
+  {
+    if( !counted.insert(&geode).second ) return;
+    usage.nodes++;
+    usage.nodeBytes += sizeof(osg::Geode);
+    countStateSet( geode.getStateSet() );
+    for( unsigned int i = 0; i < geode.getNumDrawables(); i++ )
+      countDrawable( geode.getDrawable(i) );
+  }
+
+  MemoryUsage usage;
+
+protected:
+  void countDrawable(osg::Drawable * drawable)
+  {
+    if( !drawable || !counted.insert(drawable).second ) return;
+    countStateSet( drawable->getStateSet() );
+
+    osg::Geometry * geometry = drawable->asGeometry();
+    if( !geometry ){
+      usage.nodeBytes += sizeof(osg::Drawable);
+      return;
+    }
+    usage.geometries++;
+    usage.nodeBytes += sizeof(osg::Geometry);
+
+    size_t bytes = 0;
+    osg::Geometry::ArrayList arrays;
+    geometry->getArrayList( arrays );
+    for( size_t i = 0; i < arrays.size(); i++ )
+      bytes += countBuffer( arrays[i].get() );
+    for( unsigned int i = 0; i < geometry->getNumPrimitiveSets(); i++ )
+      bytes += countBuffer( geometry->getPrimitiveSet(i) );
+
+    //display lists are counted at the size of the data compiled into them
+    if( contextID >= 0 && geometry->getUseDisplayList() && geometry->getDisplayList(contextID) != 0 )
+      usage.gpuBufferBytes += bytes;
+  }
+
+  size_t countBuffer(osg::BufferData * data)
+  {
+    if( !data || !counted.insert(data).second ) return 0;
+    size_t bytes = data->getTotalDataSize();
+    usage.geometryBytes += bytes;
+
+    if( contextID >= 0 && data->getBufferObject() ){
+      osg::GLBufferObject * glBuffer = data->getBufferObject()->getGLBufferObject(contextID);
+      if( glBuffer && counted.insert(glBuffer).second )
+        usage.gpuBufferBytes += glBuffer->getProfile()._size;
+    }
+    return bytes;
+  }
+
+  void countStateSet(osg::StateSet * stateSet)
+  {
+    if( !stateSet || !counted.insert(stateSet).second ) return;
+    usage.stateSets++;
+
+    size_t entries = stateSet->getModeList().size() + stateSet->getAttributeList().size() +
+                     stateSet->getUniformList().size();
+    const osg::StateSet::TextureAttributeList & textureAttributes = stateSet->getTextureAttributeList();
+    for( unsigned int unit = 0; unit < textureAttributes.size(); unit++ ){
+      entries += textureAttributes[unit].size();
+      countTexture( dynamic_cast<osg::Texture*>( stateSet->getTextureAttribute(unit, osg::StateAttribute::TEXTURE) ) );
+    }
+    usage.stateSetBytes += sizeof(osg::StateSet) + entries * STATE_ENTRY_BYTES;
+  }
+
+  void countTexture(osg::Texture * texture)
+  {
+    if( !texture || !counted.insert(texture).second ) return;
+    usage.textures++;
+
+    for( unsigned int i = 0; i < texture->getNumImages(); i++ ){
+      osg::Image * image = texture->getImage(i);
+      if( image && counted.insert(image).second )
+        usage.textureBytes += image->getTotalSizeInBytesIncludingMipmaps();
+    }
+
+    if( contextID >= 0 ){
+      osg::Texture::TextureObject * textureObject = texture->getTextureObject(contextID);
+      if( textureObject )
+        usage.gpuTextureBytes += textureObject->_profile._size;
+    }
+  }
+
+  int contextID;
+  std::set<const osg::Referenced*> counted;
+};
+
+inline double toMegabytes(size_t bytes){
+  return bytes / (1024.0 * 1024.0);
+}
+
+inline MemoryUsage getMemoryUsage(osg::Node * node, int contextID = -1){
+  MemoryVisitor visitor( contextID );
+  node->accept( visitor );
+  return visitor.usage;
+}
+
+#endif
@@ -10,6 +10,28 @@
 #include <osg/ShapeDrawable>
 #include <osg/CopyOp>
 #include <osgUtil/IntersectVisitor>
+#include <osg/Program>
+#include <osg/Texture2D>
+#include <osg/Timer>
+#include <osg/ArgumentParser>
+#include <osg/ComputeBoundsVisitor>
+#include <osgGA/TrackballManipulator>
+#include <osgDB/Registry>
+#include <osgDB/FileUtils>
+#include <osgUtil/IncrementalCompileOperation>
+#include <emmintrin.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <vector>
+
+#include "MemoryVisitor.h"
 
 class IntersectRef : public osg::Referenced 
 {
@@ -56,9 +78,1375 @@ public:
 };
 
 
+// Texture cache ---
+//
+// --build-texture-cache compresses every texture of the scene to DXT with a
+// full mip chain, using the driver in an offscreen context, and writes one
+// cache file per image into TEXTURE_CACHE_DIR. At runtime the cache files are
+// memory mapped instead of decoding the original images, and the textured
+// parts of the scene are uploaded a few objects per frame. --no-texture-cache
+// loads the original images and uploads everything in the first frame.
+
+#define TEXTURE_CACHE_DIR "texcache"
+#define UPLOAD_TARGET_FPS 60.0
+#define UPLOAD_BUDGET_MS 2.0 // no new object is started after this, a started one is finished
+#define UPLOAD_OBJECTS_PER_FRAME 2
+
+struct TextureCacheHeader
+{
+  char magic[4];
+  unsigned int width;
+  unsigned int height;
+  unsigned int internalFormat;
+  unsigned int pixelFormat;
+  unsigned int dataSize;    // all mipmap levels
+  unsigned int numMipmaps;  // levels after the first, followed by their offsets
+};
+
+std::string getTextureCacheFile(const std::string& imageFile)
+{
+  std::string name = imageFile;
+  std::replace(name.begin(), name.end(), '/', '_');
+  std::replace(name.begin(), name.end(), '\\', '_');
+  return std::string(TEXTURE_CACHE_DIR) + "/" + name + ".txc";
+}
+
+// Keeps a cache file mapped for as long as the image using it lives.
+class MappedFile : public osg::Referenced
+{
+public:
+  MappedFile(void* data, size_t size)
+  {
+    this->data = data;
+    this->size = size;
+  }
+
+  unsigned char* getData() { return (unsigned char*)data; }
+
+  size_t getSize() { return size; }
+
+protected:
+  virtual ~MappedFile() { munmap(data, size); }
+
+  void* data;
+  size_t size;
+};
+
+osg::Image* readCachedImage(const std::string& imageFile)
+{
+  std::string cacheFile = getTextureCacheFile(imageFile);
+  std::string sourceFile = osgDB::findDataFile(imageFile);
+
+  // a cache file older than its source is stale
+  struct stat cacheStat, sourceStat;
+  if(stat(cacheFile.c_str(), &cacheStat) != 0)
+    return NULL;
+  if(!sourceFile.empty() && stat(sourceFile.c_str(), &sourceStat) == 0 &&
+     sourceStat.st_mtime > cacheStat.st_mtime)
+    return NULL;
+
+  int fd = open(cacheFile.c_str(), O_RDONLY);
+  if(fd < 0)
+    return NULL;
+  void* data = mmap(NULL, cacheStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED)
+    return NULL;
+  osg::ref_ptr<MappedFile> file = new MappedFile(data, cacheStat.st_size);
+
+  const TextureCacheHeader* header = (const TextureCacheHeader*)file->getData();
+  if(file->getSize() < sizeof(TextureCacheHeader) || memcmp(header->magic, "TXC1", 4) != 0 ||
+     file->getSize() < sizeof(TextureCacheHeader) + header->numMipmaps * sizeof(unsigned int) + header->dataSize)
+  {
+    osg::notify(osg::WARN) << "Ignoring broken texture cache " << cacheFile << std::endl;
+    return NULL;
+  }
+
+  // let the kernel read the file in the background, the pages are needed at upload
+  madvise(data, file->getSize(), MADV_WILLNEED);
+
+  const unsigned int* offsets = (const unsigned int*)(header + 1);
+  size_t dataOffset = sizeof(TextureCacheHeader) + header->numMipmaps * sizeof(unsigned int);
+  osg::Image::MipmapDataType mipmaps(offsets, offsets + header->numMipmaps);
+  // keeps the size computed below from overflowing
+  if(header->width > 16384 || header->height > 16384)
+  {
+    osg::notify(osg::WARN) << "Ignoring texture cache with a bad size " << cacheFile << std::endl;
+    return NULL;
+  }
+  for(size_t i = 0; i < mipmaps.size(); i++)
+  {
+    if(mipmaps[i] >= header->dataSize || (i > 0 && mipmaps[i] <= mipmaps[i - 1]))
+    {
+      osg::notify(osg::WARN) << "Ignoring texture cache with bad mipmap offsets " << cacheFile << std::endl;
+      return NULL;
+    }
+  }
+
+  osg::ref_ptr<osg::Image> image = new osg::Image();
+  image->setFileName(imageFile);
+  image->setImage(header->width, header->height, 1, header->internalFormat, header->pixelFormat,
+                  GL_UNSIGNED_BYTE, file->getData() + dataOffset, osg::Image::NO_DELETE);
+  image->setMipmapLevels(mipmaps);
+
+  // the upload reads what the format and size call for, which has to be inside the file
+  if(image->getTotalSizeInBytesIncludingMipmaps() > header->dataSize)
+  {
+    osg::notify(osg::WARN) << "Ignoring texture cache smaller than its image " << cacheFile << std::endl;
+    return NULL;
+  }
+  image->setUserData(file.get());
+  return image.release();
+}
+
+bool writeTextureCache(const osg::Image* image, const std::string& imageFile)
+{
+  TextureCacheHeader header;
+  memcpy(header.magic, "TXC1", 4);
+  header.width = image->s();
+  header.height = image->t();
+  header.internalFormat = image->getInternalTextureFormat();
+  header.pixelFormat = image->getPixelFormat();
+  header.dataSize = image->getTotalSizeInBytesIncludingMipmaps();
+  header.numMipmaps = image->getMipmapLevels().size();
+
+  std::ofstream out(getTextureCacheFile(imageFile).c_str(), std::ios::binary);
+  out.write((const char*)&header, sizeof(header));
+  if(header.numMipmaps > 0)
+    out.write((const char*)&image->getMipmapLevels()[0], header.numMipmaps * sizeof(unsigned int));
+  out.write((const char*)image->data(), header.dataSize);
+  return out.good();
+}
+
+// Serves images from the texture cache when there is an up to date cache file.
+class CachedImageReadCallback : public osgDB::Registry::ReadFileCallback
+{
+public:
+  CachedImageReadCallback() : cachedImages(0) {}
+
+  virtual osgDB::ReaderWriter::ReadResult readImage(const std::string& fileName,
+                                                    const osgDB::Options* options)
+  {
+    osg::Image* image = readCachedImage(fileName);
+    if(image)
+    {
+      cachedImages++;
+      return image;
+    }
+    return osgDB::Registry::ReadFileCallback::readImage(fileName, options);
+  }
+
+  int cachedImages;
+};
+
+// Collects the textures of a scene graph.
+class TextureVisitor : public osg::NodeVisitor
+{
+public:
+  TextureVisitor() : osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN) {}
+
+  virtual void apply(osg::Node& node)
+  {
+    collect(node.getStateSet());
+    traverse(node);
+  }
+
+  virtual void apply(osg::Geode& geode)
+  {
+    collect(geode.getStateSet());
+    for(unsigned int i = 0; i < geode.getNumDrawables(); i++)
+      collect(geode.getDrawable(i)->getStateSet());
+    traverse(geode);
+  }
+
+  std::set<osg::Texture*> textures;
+
+protected:
+  void collect(osg::StateSet* state)
+  {
+    if(!state)
+      return;
+    for(unsigned int unit = 0; unit < state->getTextureAttributeList().size(); unit++)
+    {
+      osg::Texture* texture = dynamic_cast<osg::Texture*>(
+          state->getTextureAttribute(unit, osg::StateAttribute::TEXTURE));
+      if(texture)
+        textures.insert(texture);
+    }
+  }
+};
+
+// Texture memory of a scene: what it uses now and what the same textures
+// would take as uncompressed RGBA with mipmaps.
+void printTextureMemory(osg::Node* scene, int cachedImages)
+{
+  TextureVisitor visitor;
+  scene->accept(visitor);
+
+  std::set<osg::Image*> images;
+  for(std::set<osg::Texture*>::iterator it = visitor.textures.begin(); it != visitor.textures.end(); ++it)
+    for(unsigned int i = 0; i < (*it)->getNumImages(); i++)
+      if((*it)->getImage(i))
+        images.insert((*it)->getImage(i));
+
+  double used = 0.0;
+  double uncompressed = 0.0;
+  for(std::set<osg::Image*>::iterator it = images.begin(); it != images.end(); ++it)
+  {
+    osg::Image* image = *it;
+    double rgba = image->s() * image->t() * 4.0 * 4.0 / 3.0;
+    uncompressed += rgba;
+    // mipmaps missing from the image are generated on the gpu
+    used += image->isMipmap() ? image->getTotalSizeInBytesIncludingMipmaps() :
+                                image->getTotalSizeInBytes() * 4.0 / 3.0;
+  }
+  std::cout << images.size() << " textures, " << cachedImages << " from the cache: "
+            << used / 1024.0 << " KB, " << uncompressed / 1024.0 << " KB as uncompressed RGBA" << std::endl;
+}
+
+osg::GraphicsContext* createPbuffer(int width, int height)
+{
+  osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+  traits->x = 0;
+  traits->y = 0;
+  traits->width = width;
+  traits->height = height;
+  traits->pbuffer = true;
+  traits->doubleBuffer = false;
+  return osg::GraphicsContext::createGraphicsContext(traits.get());
+}
+
+// Offline step: compresses the textures of the given files with the driver
+// and stores the result with the mip chain read back from the gpu.
+int buildTextureCache(const std::vector<std::string>& files)
+{
+  osg::ref_ptr<osg::GraphicsContext> gc = createPbuffer(64, 64);
+  if(!gc.valid() || !gc->realize() || !gc->makeCurrent())
+  {
+    osg::notify(osg::FATAL) << "Could not create a context for the texture cache" << std::endl;
+    return 1;
+  }
+  osgDB::makeDirectory(TEXTURE_CACHE_DIR);
+
+  std::set<osg::Texture*> textures;
+  std::vector< osg::ref_ptr<osg::Object> > loaded;
+  for(size_t i = 0; i < files.size(); i++)
+  {
+    osg::ref_ptr<osg::Object> object = osgDB::readObjectFile(files[i]);
+    osg::Node* node = dynamic_cast<osg::Node*>(object.get());
+    osg::Image* image = dynamic_cast<osg::Image*>(object.get());
+    if(node)
+    {
+      TextureVisitor visitor;
+      node->accept(visitor);
+      textures.insert(visitor.textures.begin(), visitor.textures.end());
+    }
+    else if(image)
+      textures.insert(new osg::Texture2D(image));
+    loaded.push_back(object);
+  }
+
+  int written = 0;
+  for(std::set<osg::Texture*>::iterator it = textures.begin(); it != textures.end(); ++it)
+  {
+    osg::Texture2D* source = dynamic_cast<osg::Texture2D*>(*it);
+    if(!source || !source->getImage() || source->getImage()->getFileName().empty())
+      continue;
+    osg::Image* image = source->getImage();
+
+    osg::ref_ptr<osg::Texture2D> texture = new osg::Texture2D(image);
+    texture->setInternalFormatMode(image->isImageTranslucent() ?
+                                   osg::Texture::USE_S3TC_DXT5_COMPRESSION :
+                                   osg::Texture::USE_S3TC_DXT1_COMPRESSION);
+    texture->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR_MIPMAP_LINEAR);
+    texture->setUseHardwareMipMapGeneration(true);
+    texture->apply(*gc->getState());
+
+    osg::ref_ptr<osg::Image> compressed = new osg::Image();
+    compressed->readImageFromCurrentTexture(gc->getState()->getContextID(), true, GL_UNSIGNED_BYTE);
+    if(writeTextureCache(compressed.get(), image->getFileName()))
+    {
+      std::cout << image->getFileName() << ": " << image->getTotalSizeInBytes() / 1024 << " KB -> "
+                << compressed->getTotalSizeInBytesIncludingMipmaps() / 1024 << " KB with "
+                << compressed->getNumMipmapLevels() << " levels" << std::endl;
+      written++;
+    }
+  }
+  gc->releaseContext();
+
+  std::cout << written << " textures written to " << TEXTURE_CACHE_DIR << std::endl;
+  return 0;
+}
+
+// Parts of the scene that are attached once their textures and geometry are uploaded.
+std::vector< std::pair< osg::ref_ptr<osg::Group>, osg::ref_ptr<osg::Node> > > pendingUploads;
+
+void addWhenUploaded(osg::Group* parent, osg::Node* child)
+{
+  pendingUploads.push_back(std::make_pair(parent, child));
+}
+
+// Hands the pending parts to an incremental compile operation that uploads
+// at most UPLOAD_OBJECTS_PER_FRAME objects within UPLOAD_BUDGET_MS per frame.
+// Must be called after the viewer is realized.
+osgUtil::IncrementalCompileOperation* startUploads(osgViewer::Viewer& viewer)
+{
+  osgUtil::IncrementalCompileOperation* ico = new osgUtil::IncrementalCompileOperation();
+  // the compile time of a frame is max(time left * ratio, minimum), with the
+  // ratio scaled to the budget and the budget as the minimum it is always the budget
+  ico->setTargetFrameRate(UPLOAD_TARGET_FPS);
+  ico->setConservativeTimeRatio(UPLOAD_BUDGET_MS / 1000.0 * UPLOAD_TARGET_FPS);
+  ico->setMinimumTimeAvailableForGLCompileAndDeletePerFrame(UPLOAD_BUDGET_MS / 1000.0);
+  ico->setMaximumNumOfObjectsToCompilePerFrame(UPLOAD_OBJECTS_PER_FRAME);
+  viewer.setIncrementalCompileOperation(ico);
+
+  for(size_t i = 0; i < pendingUploads.size(); i++)
+    ico->add(new osgUtil::IncrementalCompileOperation::CompileSet(
+                 pendingUploads[i].first.get(), pendingUploads[i].second.get()));
+  pendingUploads.clear();
+  return ico;
+}
+
+// Attaches the pending parts right away, they are all uploaded in the first frame.
+void attachUploads()
+{
+  for(size_t i = 0; i < pendingUploads.size(); i++)
+    pendingUploads[i].first->addChild(pendingUploads[i].second.get());
+  pendingUploads.clear();
+}
+
+// Longest frame while uploads are in flight, printed once they are done.
+// Without an incremental compile operation that is the first frame.
+class UploadStats
+{
+public:
+  UploadStats() : frames(0), longestFrame(0.0), done(false) {}
+
+  void frame(osgUtil::IncrementalCompileOperation* ico, double ms)
+  {
+    if(done)
+      return;
+    frames++;
+    longestFrame = std::max(longestFrame, ms);
+    if(!ico || !ico->requiresCompile())
+    {
+      std::cout << "Uploads finished after " << frames << " frames, longest frame "
+                << longestFrame << " ms" << std::endl;
+      done = true;
+    }
+  }
+
+protected:
+  int frames;
+  double longestFrame;
+  bool done;
+};
+
+/// ---
+
+// Tiled forward lighting ---
+//
+// The lights live in a float texture, the screen is split into tiles of
+// TILE_SIZE pixels and every frame the CPU bins the lights into the tiles
+// they touch. The fragment shader only loops over the lights of its tile.
+
+#define TILE_SIZE 16
+#define MAX_LIGHTS 1024
+#define INDEX_TEXTURE_WIDTH 1024
+
+static const char* tiledVertexSource =
+  "#version 130\n"
+  "varying vec3 eyePos;\n"
+  "varying vec3 eyeNormal;\n"
+  "void main()\n"
+  "{\n"
+  "  vec4 pos = gl_ModelViewMatrix * gl_Vertex;\n"
+  "  eyePos = pos.xyz;\n"
+  "  eyeNormal = gl_NormalMatrix * gl_Normal;\n"
+  "  gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+  "  gl_Position = gl_ProjectionMatrix * pos;\n"
+  "}\n";
+
+static const char* tiledFragmentSource =
+  "#version 130\n"
+  "uniform sampler2D baseTexture;\n"
+  "uniform sampler2D lightData;\n"    // row 0: eye position and radius, row 1: color
+  "uniform sampler2D tileData;\n"     // light list offset and count per tile
+  "uniform sampler2D lightIndices;\n" // four light indices per texel
+  "uniform int tileSize;\n"
+  "uniform int indexWidth;\n"
+  "varying vec3 eyePos;\n"
+  "varying vec3 eyeNormal;\n"
+  "void main()\n"
+  "{\n"
+  "  vec2 range = texelFetch(tileData, ivec2(gl_FragCoord.xy) / tileSize, 0).xy;\n"
+  "  int offset = int(range.x);\n"
+  "  int count = int(range.y);\n"
+  "  vec3 normal = normalize(eyeNormal);\n"
+  "  vec3 base = gl_FrontMaterial.diffuse.rgb * texture2D(baseTexture, gl_TexCoord[0].st).rgb;\n"
+  "  vec3 color = gl_FrontMaterial.ambient.rgb * gl_LightModel.ambient.rgb * base;\n"
+  "  for(int i = 0; i < count; i++)\n"
+  "  {\n"
+  "    int index = offset + i;\n"
+  "    int texel = index / 4;\n"
+  "    vec4 indices = texelFetch(lightIndices, ivec2(texel % indexWidth, texel / indexWidth), 0);\n"
+  "    int light = int(indices[index % 4]);\n"
+  "    vec4 posRadius = texelFetch(lightData, ivec2(light, 0), 0);\n"
+  "    vec3 toLight = posRadius.xyz - eyePos;\n"
+  "    float dist = length(toLight);\n"
+  "    if(dist < posRadius.w)\n"
+  "    {\n"
+  "      float att = 1.0 - dist / posRadius.w;\n"
+  "      vec3 lightColor = texelFetch(lightData, ivec2(light, 1), 0).rgb;\n"
+  "      color += base * lightColor * max(dot(normal, toLight / dist), 0.0) * att * att;\n"
+  "    }\n"
+  "  }\n"
+  "  gl_FragColor = vec4(color, gl_FrontMaterial.diffuse.a);\n"
+  "}\n";
+
+osg::Texture2D* createFloatTexture(osg::Image* image)
+{
+  osg::Texture2D* texture = new osg::Texture2D(image);
+  texture->setInternalFormat(GL_RGBA32F_ARB);
+  texture->setSourceFormat(GL_RGBA);
+  texture->setSourceType(GL_FLOAT);
+  texture->setFilter(osg::Texture::MIN_FILTER, osg::Texture::NEAREST);
+  texture->setFilter(osg::Texture::MAG_FILTER, osg::Texture::NEAREST);
+  texture->setResizeNonPowerOfTwoHint(false);
+  texture->setDataVariance(osg::Object::DYNAMIC);
+  return texture;
+}
+
+// Uploads only the rows of the light index list that the last binning
+// filled. The texture is bound every frame, the rows are only sent when
+// the image was changed since the last upload.
+class IndexUploadCallback : public osg::Texture2D::SubloadCallback
+{
+public:
+  IndexUploadCallback() : usedRows(0), uploadedCount(0) {}
+
+  virtual void load(const osg::Texture2D& texture, osg::State&) const
+  {
+    const osg::Image* image = texture.getImage();
+    glTexImage2D(GL_TEXTURE_2D, 0, texture.getInternalFormat(), image->s(), image->t(), 0,
+                 GL_RGBA, GL_FLOAT, NULL);
+    upload(image);
+  }
+
+  virtual void subload(const osg::Texture2D& texture, osg::State&) const
+  {
+    const osg::Image* image = texture.getImage();
+    if(image->getModifiedCount() != uploadedCount)
+      upload(image);
+  }
+
+  int usedRows;
+
+protected:
+  void upload(const osg::Image* image) const
+  {
+    glPixelStorei(GL_UNPACK_ALIGNMENT, image->getPacking());
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image->s(), std::min(usedRows, image->t()),
+                    GL_RGBA, GL_FLOAT, image->data());
+    uploadedCount = image->getModifiedCount();
+  }
+
+  mutable unsigned int uploadedCount;
+};
+
+class TiledLighting : public osg::Referenced
+{
+public:
+  // The two scene lights are kept as the first lights in the buffer,
+  // the rest are animated point lights circling over the ground.
+  TiledLighting(osg::Group* root, osg::Light* light, osg::Light* light2,
+                osg::MatrixTransform* light2T)
+  {
+    this->root = root;
+    this->light = light;
+    this->light2 = light2;
+    this->light2T = light2T;
+    this->tilesX = 0;
+    this->tilesY = 0;
+    this->width = 0;
+    this->height = 0;
+    this->averageLightsPerTile = 0.0f;
+    this->indexUpload = new IndexUploadCallback();
+    setNumLights(2);
+
+    lightImage = new osg::Image();
+    lightImage->allocateImage(MAX_LIGHTS, 2, 1, GL_RGBA, GL_FLOAT);
+
+    osg::StateSet* state = root->getOrCreateStateSet();
+    osg::ref_ptr<osg::Program> program = new osg::Program();
+    program->addShader(new osg::Shader(osg::Shader::VERTEX, tiledVertexSource));
+    program->addShader(new osg::Shader(osg::Shader::FRAGMENT, tiledFragmentSource));
+    state->setAttributeAndModes(program);
+
+    // white default so untextured geometry keeps its material color
+    osg::ref_ptr<osg::Image> white = new osg::Image();
+    white->allocateImage(1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+    *(osg::Vec4ub*)white->data() = osg::Vec4ub(255, 255, 255, 255);
+    state->setTextureAttributeAndModes(0, new osg::Texture2D(white));
+
+    // no texture modes on the data units, fixed function geometry would be modulated by them
+    state->setTextureAttribute(1, createFloatTexture(lightImage));
+    state->addUniform(new osg::Uniform("baseTexture", 0));
+    state->addUniform(new osg::Uniform("lightData", 1));
+    state->addUniform(new osg::Uniform("tileData", 2));
+    state->addUniform(new osg::Uniform("lightIndices", 3));
+    state->addUniform(new osg::Uniform("tileSize", TILE_SIZE));
+    state->addUniform(new osg::Uniform("indexWidth", INDEX_TEXTURE_WIDTH));
+  }
+
+  void setNumLights(int n)
+  {
+    numLights = osg::clampBetween(n, 2, MAX_LIGHTS);
+    // pad to whole SSE batches, padding lights are placed behind the camera
+    int padded = (numLights + 3) & ~3;
+    posX.assign(padded, 0.0f);
+    posY.assign(padded, 0.0f);
+    posZ.assign(padded, 1.0e6f);
+    radius.assign(padded, 0.0f);
+  }
+
+  int getNumLights() { return numLights; }
+
+  float getAverageLightsPerTile() { return averageLightsPerTile; }
+
+  // Animates the lights, moves them to eye space and bins them into the
+  // tiles of the camera viewport. Must run after the update traversal.
+  void update(osg::Camera* camera, double time)
+  {
+    const osg::Viewport* vp = camera->getViewport();
+    // a minimized window has no tiles to bin the lights into
+    if(!vp || vp->width() < 1 || vp->height() < 1)
+      return;
+    resizeTiles(int(vp->width()), int(vp->height()));
+
+    const osg::Matrix& view = camera->getViewMatrix();
+    float* lightPos = (float*)lightImage->data(0, 0);
+    float* lightColor = (float*)lightImage->data(0, 1);
+
+    for(int i = 0; i < numLights; i++)
+    {
+      osg::Vec3 world;
+      osg::Vec4 color;
+      float r;
+      if(i == 0)
+      {
+        osg::Vec4 p = light->getPosition();
+        world = osg::Vec3(p.x(), p.y(), p.z());
+        color = light->getDiffuse();
+        r = 2000.0f;
+      }
+      else if(i == 1)
+      {
+        osg::Vec4 p = light2->getPosition();
+        world = osg::Vec3(p.x(), p.y(), p.z()) * light2T->getMatrix();
+        color = light2->getDiffuse();
+        r = 2000.0f;
+      }
+      else
+      {
+        // deterministic orbit per light so every run looks the same
+        float phase = i * 2.399963f;
+        float orbit = 50.0f + (i * 37 % 400);
+        float speed = 0.2f + (i % 7) * 0.1f;
+        osg::Vec3 center((i * 73 % 256) * 5.0f, (i * 151 % 256) * 5.0f, 40.0f);
+        world = center + osg::Vec3(cos(phase + speed * time) * orbit,
+                                   sin(phase + speed * time) * orbit, 0.0f);
+        color = osg::Vec4(0.5f + 0.5f * sin(phase), 0.5f + 0.5f * sin(phase + 2.1f),
+                          0.5f + 0.5f * sin(phase + 4.2f), 1.0f);
+        r = 150.0f;
+      }
+
+      osg::Vec3 eye = world * view;
+      posX[i] = eye.x();
+      posY[i] = eye.y();
+      posZ[i] = eye.z();
+      radius[i] = r;
+
+      lightPos[i * 4 + 0] = eye.x();
+      lightPos[i * 4 + 1] = eye.y();
+      lightPos[i * 4 + 2] = eye.z();
+      lightPos[i * 4 + 3] = r;
+      lightColor[i * 4 + 0] = color.r();
+      lightColor[i * 4 + 1] = color.g();
+      lightColor[i * 4 + 2] = color.b();
+      lightColor[i * 4 + 3] = 1.0f;
+    }
+    lightImage->dirty();
+
+    binLights(camera->getProjectionMatrix());
+  }
+
+protected:
+  void resizeTiles(int width, int height)
+  {
+    if(width == this->width && height == this->height)
+      return;
+
+    this->width = width;
+    this->height = height;
+    tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    tileImage = new osg::Image();
+    tileImage->allocateImage(tilesX, tilesY, 1, GL_RGBA, GL_FLOAT);
+    root->getOrCreateStateSet()->setTextureAttribute(2, createFloatTexture(tileImage));
+    // one light per tile to start with, the list grows with the first frames
+    allocateIndices(tilesX * tilesY);
+
+    tileCounts.resize(tilesX * tilesY);
+  }
+
+  void allocateIndices(int numIndices)
+  {
+    int indexRows = (numIndices / 4 + INDEX_TEXTURE_WIDTH - 1) / INDEX_TEXTURE_WIDTH;
+    indexImage = new osg::Image();
+    indexImage->allocateImage(INDEX_TEXTURE_WIDTH, std::max(indexRows, 1), 1, GL_RGBA, GL_FLOAT);
+    osg::Texture2D* texture = createFloatTexture(indexImage);
+    texture->setTextureSize(indexImage->s(), indexImage->t());
+    texture->setSubloadCallback(indexUpload);
+    root->getOrCreateStateSet()->setTextureAttribute(3, texture);
+  }
+
+  // Screen space tile rectangle of every light, four lights per iteration.
+  // The rectangle is the conservative bound of x/w and y/w over the light
+  // sphere, lights crossing the near plane cover the whole screen.
+  void computeTileRects(const osg::Matrix& proj)
+  {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 p00 = _mm_set1_ps(proj(0,0)), p20 = _mm_set1_ps(proj(2,0));
+    const __m128 p11 = _mm_set1_ps(proj(1,1)), p21 = _mm_set1_ps(proj(2,1));
+    const __m128 extentX = _mm_set1_ps(fabs(proj(0,0)) + fabs(proj(2,0)));
+    const __m128 extentY = _mm_set1_ps(fabs(proj(1,1)) + fabs(proj(2,1)));
+    const __m128 nearLimit = _mm_set1_ps(0.01f);
+    const __m128 scaleX = _mm_set1_ps(0.5f * width / TILE_SIZE);
+    const __m128 scaleY = _mm_set1_ps(0.5f * height / TILE_SIZE);
+    const __m128 maxX = _mm_set1_ps(tilesX - 1), maxY = _mm_set1_ps(tilesY - 1);
+
+    for(size_t i = 0; i < posX.size(); i += 4)
+    {
+      __m128 x = _mm_loadu_ps(&posX[i]);
+      __m128 y = _mm_loadu_ps(&posY[i]);
+      __m128 z = _mm_loadu_ps(&posZ[i]);
+      __m128 r = _mm_loadu_ps(&radius[i]);
+
+      // w = -z for points of the sphere
+      __m128 wNear = _mm_sub_ps(_mm_sub_ps(zero, z), r);
+      __m128 wFar = _mm_add_ps(_mm_sub_ps(zero, z), r);
+
+      __m128 cx = _mm_add_ps(_mm_mul_ps(p00, x), _mm_mul_ps(p20, z));
+      __m128 cy = _mm_add_ps(_mm_mul_ps(p11, y), _mm_mul_ps(p21, z));
+      __m128 loX = _mm_sub_ps(cx, _mm_mul_ps(extentX, r));
+      __m128 hiX = _mm_add_ps(cx, _mm_mul_ps(extentX, r));
+      __m128 loY = _mm_sub_ps(cy, _mm_mul_ps(extentY, r));
+      __m128 hiY = _mm_add_ps(cy, _mm_mul_ps(extentY, r));
+
+      // spheres crossing the near plane get the whole screen
+      __m128 crossing = _mm_cmplt_ps(wNear, nearLimit);
+      __m128 safeNear = _mm_max_ps(wNear, nearLimit);
+      __m128 minX = _mm_min_ps(_mm_div_ps(loX, safeNear), _mm_div_ps(loX, wFar));
+      __m128 maxNdcX = _mm_max_ps(_mm_div_ps(hiX, safeNear), _mm_div_ps(hiX, wFar));
+      __m128 minY = _mm_min_ps(_mm_div_ps(loY, safeNear), _mm_div_ps(loY, wFar));
+      __m128 maxNdcY = _mm_max_ps(_mm_div_ps(hiY, safeNear), _mm_div_ps(hiY, wFar));
+      minX = _mm_or_ps(_mm_and_ps(crossing, _mm_set1_ps(-1.0f)), _mm_andnot_ps(crossing, minX));
+      minY = _mm_or_ps(_mm_and_ps(crossing, _mm_set1_ps(-1.0f)), _mm_andnot_ps(crossing, minY));
+      maxNdcX = _mm_or_ps(_mm_and_ps(crossing, one), _mm_andnot_ps(crossing, maxNdcX));
+      maxNdcY = _mm_or_ps(_mm_and_ps(crossing, one), _mm_andnot_ps(crossing, maxNdcY));
+
+      // ndc to tiles, clamped to the screen
+      __m128 tx0 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_add_ps(minX, one), scaleX), zero), maxX);
+      __m128 tx1 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_add_ps(maxNdcX, one), scaleX), zero), maxX);
+      __m128 ty0 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_add_ps(minY, one), scaleY), zero), maxY);
+      __m128 ty1 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_add_ps(maxNdcY, one), scaleY), zero), maxY);
+
+      // lights behind the camera or outside the screen get an empty rectangle
+      __m128 hidden = _mm_or_ps(_mm_cmple_ps(wFar, zero),
+                      _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(minX, one), _mm_cmplt_ps(maxNdcX, _mm_set1_ps(-1.0f))),
+                                _mm_or_ps(_mm_cmpgt_ps(minY, one), _mm_cmplt_ps(maxNdcY, _mm_set1_ps(-1.0f)))));
+      tx1 = _mm_or_ps(_mm_and_ps(hidden, _mm_set1_ps(-1.0f)), _mm_andnot_ps(hidden, tx1));
+
+      int rect[4][4];
+      _mm_storeu_si128((__m128i*)rect[0], _mm_cvttps_epi32(tx0));
+      _mm_storeu_si128((__m128i*)rect[1], _mm_cvttps_epi32(tx1));
+      _mm_storeu_si128((__m128i*)rect[2], _mm_cvttps_epi32(ty0));
+      _mm_storeu_si128((__m128i*)rect[3], _mm_cvttps_epi32(ty1));
+      for(int j = 0; j < 4; j++)
+      {
+        tileRects[(i + j) * 4 + 0] = rect[0][j];
+        tileRects[(i + j) * 4 + 1] = rect[1][j];
+        tileRects[(i + j) * 4 + 2] = rect[2][j];
+        tileRects[(i + j) * 4 + 3] = rect[3][j];
+      }
+    }
+  }
+
+  void binLights(const osg::Matrix& proj)
+  {
+    tileRects.resize(posX.size() * 4);
+    computeTileRects(proj);
+
+    // count the lights per tile, then give every tile its range in the index list
+    std::fill(tileCounts.begin(), tileCounts.end(), 0);
+    for(int i = 0; i < numLights; i++)
+    {
+      const int* rect = &tileRects[i * 4];
+      for(int y = rect[2]; y <= rect[3]; y++)
+        for(int x = rect[0]; x <= rect[1]; x++)
+          tileCounts[y * tilesX + x]++;
+    }
+
+    float* tiles = (float*)tileImage->data();
+    int offset = 0;
+    for(size_t t = 0; t < tileCounts.size(); t++)
+    {
+      int count = tileCounts[t];
+      tiles[t * 4 + 0] = float(offset);
+      tiles[t * 4 + 1] = float(count);
+      // reused as the fill position of the tile
+      tileCounts[t] = offset;
+      offset += count;
+    }
+    averageLightsPerTile = float(offset) / tileCounts.size();
+
+    // every light of every tile is kept, the index list grows when it is too small
+    if(offset > indexImage->s() * indexImage->t() * 4)
+      allocateIndices(offset * 2);
+    indexUpload->usedRows = (offset / 4 + INDEX_TEXTURE_WIDTH - 1) / INDEX_TEXTURE_WIDTH;
+
+    float* indices = (float*)indexImage->data();
+    for(int i = 0; i < numLights; i++)
+    {
+      const int* rect = &tileRects[i * 4];
+      for(int y = rect[2]; y <= rect[3]; y++)
+        for(int x = rect[0]; x <= rect[1]; x++)
+        {
+          indices[tileCounts[y * tilesX + x]++] = float(i);
+        }
+    }
+
+    tileImage->dirty();
+    indexImage->dirty();
+  }
+
+  osg::Group* root;
+  osg::Light* light;
+  osg::Light* light2;
+  osg::MatrixTransform* light2T;
+  int numLights;
+  int width, height;
+  int tilesX, tilesY;
+  float averageLightsPerTile;
+
+  osg::ref_ptr<osg::Image> lightImage;
+  osg::ref_ptr<osg::Image> tileImage;
+  osg::ref_ptr<osg::Image> indexImage;
+  osg::ref_ptr<IndexUploadCallback> indexUpload;
+
+  // eye space light spheres, structure of arrays for SSE
+  std::vector<float> posX, posY, posZ, radius;
+  std::vector<int> tileRects;
+  std::vector<int> tileCounts;
+};
+
+// One frame, with the lights binned between the update and rendering traversals.
+void renderFrame(osgViewer::Viewer& viewer, TiledLighting* lighting)
+{
+  viewer.advance();
+  viewer.eventTraversal();
+  viewer.updateTraversal();
+  if(lighting)
+    lighting->update(viewer.getCamera(), viewer.getFrameStamp()->getSimulationTime());
+  viewer.renderingTraversals();
+}
+
+// Renders into an offscreen pbuffer with 2 to MAX_LIGHTS lights and prints
+// the average frame time for each light count.
+int runLightBenchmark(osgViewer::Viewer& viewer, TiledLighting* lighting)
+{
+  const int warmupFrames = 50;
+  const int measuredFrames = 200;
+
+  const int width = 1280;
+  const int height = 720;
+
+  osg::ref_ptr<osg::GraphicsContext> gc = createPbuffer(width, height);
+  if(!gc.valid())
+  {
+    osg::notify(osg::FATAL) << "Could not create a pbuffer for the benchmark" << std::endl;
+    return 1;
+  }
+
+  osg::Camera* camera = viewer.getCamera();
+  camera->setGraphicsContext(gc.get());
+  camera->setViewport(0, 0, width, height);
+  camera->setProjectionMatrixAsPerspective(30.0, double(width) / height, 1.0, 10000.0);
+  camera->setViewMatrixAsLookAt(osg::Vec3(640, -600, 800), osg::Vec3(640, 640, 0), osg::Vec3(0, 0, 1));
+  viewer.setThreadingModel(osgViewer::Viewer::SingleThreaded);
+  viewer.realize();
+
+  osg::ref_ptr<osgUtil::IncrementalCompileOperation> ico = startUploads(viewer);
+  while(ico->requiresCompile())
+    renderFrame(viewer, lighting);
+
+  for(int n = 2; n <= MAX_LIGHTS; n *= 2)
+  {
+    lighting->setNumLights(n);
+    osg::Timer_t start = 0;
+    for(int frame = 0; frame < warmupFrames + measuredFrames; frame++)
+    {
+      if(frame == warmupFrames)
+        start = osg::Timer::instance()->tick();
+      renderFrame(viewer, lighting);
+    }
+    double ms = osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick()) / measuredFrames;
+    std::cout << n << " lights: " << ms << " ms/frame, "
+              << lighting->getAverageLightsPerTile() << " lights per tile" << std::endl;
+  }
+  return 0;
+}
+
+/// ---
+
+// Impostors ---
+//
+// Distant dumptrucks are drawn as billboards from a shared atlas that holds
+// the model seen from IMPOSTOR_AZIMUTHS x IMPOSTOR_ELEVATIONS directions.
+// Every truck picks the cell closest to its view direction and only changes
+// its vertices when it moves to another cell, the atlas is baked again when
+// a light turns by more than IMPOSTOR_LIGHT_ANGLE or changes its color by
+// more than IMPOSTOR_LIGHT_COLOR. All billboards are one
+// geometry and one draw call. The lighting is baked in world space, so the
+// trucks keep the heading of the model.
+
+#define IMPOSTOR_AZIMUTHS 16
+#define IMPOSTOR_ELEVATIONS 4
+#define IMPOSTOR_MAX_ELEVATION 75.0f // degrees
+#define IMPOSTOR_CELL_SIZE 128       // pixels
+#define IMPOSTOR_DISTANCE 100.0f     // in the units of the LOD ranges
+#define IMPOSTOR_LIGHT_ANGLE 10.0f   // degrees
+#define IMPOSTOR_LIGHT_COLOR 0.1f    // largest change of a color component
+
+static const char* impostorVertexSource =
+  "#version 120\n"
+  "varying vec2 atlasCoord;\n"
+  "void main()\n"
+  "{\n"
+  "  vec4 center = gl_ModelViewMatrix * gl_Vertex;\n"
+  "  atlasCoord = gl_MultiTexCoord0.xy;\n"
+  "  gl_Position = gl_ProjectionMatrix * (center + vec4(gl_MultiTexCoord1.xy, 0.0, 0.0));\n"
+  "}\n";
+
+static const char* impostorFragmentSource =
+  "#version 120\n"
+  "uniform sampler2D atlas;\n"
+  "varying vec2 atlasCoord;\n"
+  "void main()\n"
+  "{\n"
+  "  vec4 color = texture2D(atlas, atlasCoord);\n"
+  "  if(color.a < 0.5)\n"
+  "    discard;\n"
+  "  gl_FragColor = color;\n"
+  "}\n";
+
+// Keeps a node out of the bound of its parents.
+class NoBoundCallback : public osg::Node::ComputeBoundingSphereCallback
+{
+public:
+  virtual osg::BoundingSphere computeBound(const osg::Node&) const
+  {
+    return osg::BoundingSphere();
+  }
+};
+
+// Holds the bake cameras and the billboards. Every cull picks the atlas
+// cells for the current eye and turns the bake cameras on when the atlas is stale.
+class Impostors : public osg::Group
+{
+public:
+  // switchDistance is the distance where the mesh LOD ends, in model units.
+  Impostors(osg::Node* model, float switchDistance)
+  {
+    this->model = model;
+    this->switchDistance = switchDistance;
+    this->baked = false;
+    this->numBakes = 0;
+    this->numVisible = 0;
+    this->modelBound = model->getBound();
+
+    atlas = new osg::Texture2D();
+    atlas->setTextureSize(IMPOSTOR_AZIMUTHS * IMPOSTOR_CELL_SIZE, IMPOSTOR_ELEVATIONS * IMPOSTOR_CELL_SIZE);
+    atlas->setInternalFormat(GL_RGBA);
+    atlas->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR_MIPMAP_LINEAR);
+    atlas->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+
+    bakeLights = new osg::Group();
+    createBakeCameras();
+    createBillboards();
+  }
+
+  int getNumBakes() { return numBakes; }
+
+  int getNumVisible() { return numVisible; }
+
+  // The baked lighting follows the colors of this light and its direction seen from the trucks.
+  void addLight(osg::LightSource* source)
+  {
+    osg::ref_ptr<osg::Light> light = new osg::Light(*source->getLight());
+    light->setDataVariance(osg::Object::DYNAMIC);
+    osg::ref_ptr<osg::LightSource> bakeSource = new osg::LightSource();
+    bakeSource->setLight(light);
+    bakeLights->addChild(bakeSource);
+
+    sceneLights.push_back(source);
+    bakedLights.push_back(light);
+    bakedDirections.push_back(osg::Vec3());
+    baked = false;
+  }
+
+  // A truck drawn with the model at position and scale, like its PositionAttitudeTransform.
+  void addInstance(const osg::Vec3& position, float scale)
+  {
+    Instance instance;
+    instance.center = position + modelBound.center() * scale;
+    instance.scale = scale;
+    instance.cell = -1;
+    instances.push_back(instance);
+
+    float size = modelBound.radius() * scale;
+    for(int i = 0; i < 4; i++)
+    {
+      centers->push_back(instance.center);
+      atlasCoords->push_back(osg::Vec2());
+      corners->push_back(osg::Vec2());
+    }
+    quads->setCount(centers->size());
+    bounds.expandBy(osg::BoundingSphere(instance.center, size));
+    billboards->setInitialBound(bounds);
+    billboards->dirtyBound();
+  }
+
+  virtual void traverse(osg::NodeVisitor& nv)
+  {
+    if(nv.getVisitorType() == osg::NodeVisitor::CULL_VISITOR)
+    {
+      updateBake();
+      updateCells(nv.getEyePoint());
+    }
+    osg::Group::traverse(nv);
+  }
+
+protected:
+  struct Instance
+  {
+    osg::Vec3 center;
+    float scale;
+    int cell;
+  };
+
+  // Direction from the cell of the atlas towards the camera that baked it.
+  osg::Vec3 getCellDirection(int azimuth, int elevation)
+  {
+    float a = azimuth * 2.0f * osg::PI / IMPOSTOR_AZIMUTHS;
+    float e = osg::DegreesToRadians(IMPOSTOR_MAX_ELEVATION) * elevation / (IMPOSTOR_ELEVATIONS - 1);
+    return osg::Vec3(cosf(e) * cosf(a), cosf(e) * sinf(a), sinf(e));
+  }
+
+  // One orthographic camera per cell, all rendering into the atlas with a
+  // shared depth texture. They are only traversed in frames that bake.
+  void createBakeCameras()
+  {
+    osg::ref_ptr<osg::Texture2D> depth = new osg::Texture2D();
+    depth->setTextureSize(atlas->getTextureWidth(), atlas->getTextureHeight());
+    depth->setInternalFormat(GL_DEPTH_COMPONENT24);
+    depth->setSourceFormat(GL_DEPTH_COMPONENT);
+    depth->setSourceType(GL_UNSIGNED_INT);
+
+    osg::ref_ptr<osg::Group> cameras = new osg::Group();
+    cameras->setComputeBoundingSphereCallback(new NoBoundCallback());
+    cameras->setCullingActive(false);
+    // fixed function lighting even when the scene uses tiled lighting
+    cameras->getOrCreateStateSet()->setAttributeAndModes(new osg::Program());
+    cameras->getOrCreateStateSet()->setMode(GL_LIGHTING, osg::StateAttribute::ON);
+    // and without the light data textures of tiled lighting
+    for(int unit = 1; unit <= 3; unit++)
+      cameras->getOrCreateStateSet()->setTextureMode(unit, GL_TEXTURE_2D,
+                                                     osg::StateAttribute::OFF | osg::StateAttribute::OVERRIDE);
+    addChild(cameras);
+
+    float r = modelBound.radius();
+    for(int e = 0; e < IMPOSTOR_ELEVATIONS; e++)
+    {
+      for(int a = 0; a < IMPOSTOR_AZIMUTHS; a++)
+      {
+        osg::Vec3 center = modelBound.center();
+        osg::Vec3 up = osg::Vec3(0.0f, 0.0f, 1.0f);
+        osg::ref_ptr<osg::Camera> camera = new osg::Camera();
+        camera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+        camera->setCullingActive(false);
+        camera->setRenderOrder(osg::Camera::PRE_RENDER, e * IMPOSTOR_AZIMUTHS + a);
+        camera->setRenderTargetImplementation(osg::Camera::FRAME_BUFFER_OBJECT);
+        camera->setClearMask(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        camera->setClearColor(osg::Vec4(0.0f, 0.0f, 0.0f, 0.0f));
+        camera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+        camera->setViewport(a * IMPOSTOR_CELL_SIZE, e * IMPOSTOR_CELL_SIZE, IMPOSTOR_CELL_SIZE, IMPOSTOR_CELL_SIZE);
+        camera->setProjectionMatrixAsOrtho(-r, r, -r, r, r, 5.0f * r);
+        camera->setViewMatrixAsLookAt(center + getCellDirection(a, e) * 3.0f * r, center, up);
+        // the last camera builds the mipmaps of the finished atlas
+        bool last = (e == IMPOSTOR_ELEVATIONS - 1 && a == IMPOSTOR_AZIMUTHS - 1);
+        camera->attach(osg::Camera::COLOR_BUFFER, atlas.get(), 0, 0, last);
+        camera->attach(osg::Camera::DEPTH_BUFFER, depth.get());
+        camera->addChild(bakeLights);
+        camera->addChild(model);
+        camera->setNodeMask(0);
+        cameras->addChild(camera);
+        bakeCameras.push_back(camera);
+      }
+    }
+  }
+
+  void createBillboards()
+  {
+    centers = new osg::Vec3Array();
+    atlasCoords = new osg::Vec2Array();
+    corners = new osg::Vec2Array();
+    quads = new osg::DrawArrays(osg::PrimitiveSet::QUADS, 0, 0);
+
+    billboards = new osg::Geometry();
+    billboards->setDataVariance(osg::Object::DYNAMIC);
+    billboards->setUseDisplayList(false);
+    billboards->setUseVertexBufferObjects(true);
+    billboards->setVertexArray(centers);
+    billboards->setTexCoordArray(0, atlasCoords);
+    billboards->setTexCoordArray(1, corners);
+    billboards->addPrimitiveSet(quads);
+
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode();
+    geode->addDrawable(billboards);
+    osg::StateSet* state = geode->getOrCreateStateSet();
+    osg::ref_ptr<osg::Program> program = new osg::Program();
+    program->addShader(new osg::Shader(osg::Shader::VERTEX, impostorVertexSource));
+    program->addShader(new osg::Shader(osg::Shader::FRAGMENT, impostorFragmentSource));
+    state->setAttributeAndModes(program);
+    state->setTextureAttributeAndModes(0, atlas);
+    state->addUniform(new osg::Uniform("atlas", 0));
+    state->setMode(GL_LIGHTING, osg::StateAttribute::OFF);
+    state->setMode(GL_CULL_FACE, osg::StateAttribute::OFF);
+    addChild(geode);
+  }
+
+  // Largest difference between two colors in any component.
+  static float colorDifference(const osg::Vec4& a, const osg::Vec4& b)
+  {
+    osg::Vec4 d = a - b;
+    return std::max(std::max(fabsf(d.r()), fabsf(d.g())), std::max(fabsf(d.b()), fabsf(d.a())));
+  }
+
+  // Turns the bake cameras on for this frame when a light has turned too far
+  // since the last bake, as seen from the middle of the trucks, or changed its colors.
+  void updateBake()
+  {
+    bool bake = !baked;
+    std::vector<osg::Vec3> directions(sceneLights.size());
+    for(size_t i = 0; i < sceneLights.size(); i++)
+    {
+      const osg::Light* light = sceneLights[i]->getLight();
+      if(colorDifference(light->getDiffuse(), bakedLights[i]->getDiffuse()) > IMPOSTOR_LIGHT_COLOR ||
+         colorDifference(light->getAmbient(), bakedLights[i]->getAmbient()) > IMPOSTOR_LIGHT_COLOR ||
+         colorDifference(light->getSpecular(), bakedLights[i]->getSpecular()) > IMPOSTOR_LIGHT_COLOR)
+        bake = true;
+
+      osg::NodePathList paths = sceneLights[i]->getParentalNodePaths();
+      osg::Matrix toWorld = paths.empty() ? osg::Matrix() : osg::computeLocalToWorld(paths[0]);
+      osg::Vec4 p = light->getPosition() * toWorld;
+      directions[i] = osg::Vec3(p.x(), p.y(), p.z()) - bounds.center() * p.w();
+      directions[i].normalize();
+      if(directions[i] * bakedDirections[i] < cosf(osg::DegreesToRadians(IMPOSTOR_LIGHT_ANGLE)))
+        bake = true;
+    }
+
+    for(size_t i = 0; i < bakeCameras.size(); i++)
+      bakeCameras[i]->setNodeMask(bake ? ~0u : 0u);
+    if(!bake)
+      return;
+
+    for(size_t i = 0; i < bakedLights.size(); i++)
+    {
+      const osg::Light* light = sceneLights[i]->getLight();
+      bakedLights[i]->setDiffuse(light->getDiffuse());
+      bakedLights[i]->setAmbient(light->getAmbient());
+      bakedLights[i]->setSpecular(light->getSpecular());
+      bakedLights[i]->setPosition(osg::Vec4(directions[i], 0.0f));
+      bakedDirections[i] = directions[i];
+    }
+    baked = true;
+    numBakes++;
+  }
+
+  // Moves every truck to the cell of its view direction, trucks closer than
+  // the switch distance collapse their quad and are left to the mesh LOD.
+  void updateCells(const osg::Vec3& eye)
+  {
+    float elevationStep = osg::DegreesToRadians(IMPOSTOR_MAX_ELEVATION) / (IMPOSTOR_ELEVATIONS - 1);
+    float azimuthStep = 2.0f * osg::PI / IMPOSTOR_AZIMUTHS;
+    bool changed = false;
+    numVisible = 0;
+
+    for(size_t i = 0; i < instances.size(); i++)
+    {
+      Instance& instance = instances[i];
+      osg::Vec3 toEye = eye - instance.center;
+      float distance = toEye.normalize();
+
+      int cell = -1;
+      if(distance > switchDistance * instance.scale)
+      {
+        float azimuth = atan2f(toEye.y(), toEye.x());
+        float elevation = osg::clampBetween(asinf(toEye.z()), 0.0f, osg::DegreesToRadians(IMPOSTOR_MAX_ELEVATION));
+        int a = int(floorf(azimuth / azimuthStep + 0.5f) + IMPOSTOR_AZIMUTHS) % IMPOSTOR_AZIMUTHS;
+        int e = int(elevation / elevationStep + 0.5f);
+        cell = e * IMPOSTOR_AZIMUTHS + a;
+        numVisible++;
+      }
+      if(cell == instance.cell)
+        continue;
+      instance.cell = cell;
+      changed = true;
+
+      size_t v = i * 4;
+      if(cell < 0)
+      {
+        for(int k = 0; k < 4; k++)
+          (*corners)[v + k] = osg::Vec2();
+        continue;
+      }
+      float size = modelBound.radius() * instance.scale;
+      float u0 = float(cell % IMPOSTOR_AZIMUTHS) / IMPOSTOR_AZIMUTHS;
+      float v0 = float(cell / IMPOSTOR_AZIMUTHS) / IMPOSTOR_ELEVATIONS;
+      float u1 = u0 + 1.0f / IMPOSTOR_AZIMUTHS;
+      float v1 = v0 + 1.0f / IMPOSTOR_ELEVATIONS;
+      (*corners)[v + 0] = osg::Vec2(-size, -size);
+      (*corners)[v + 1] = osg::Vec2( size, -size);
+      (*corners)[v + 2] = osg::Vec2( size,  size);
+      (*corners)[v + 3] = osg::Vec2(-size,  size);
+      (*atlasCoords)[v + 0] = osg::Vec2(u0, v0);
+      (*atlasCoords)[v + 1] = osg::Vec2(u1, v0);
+      (*atlasCoords)[v + 2] = osg::Vec2(u1, v1);
+      (*atlasCoords)[v + 3] = osg::Vec2(u0, v1);
+    }
+    if(changed)
+    {
+      corners->dirty();
+      atlasCoords->dirty();
+    }
+  }
+
+  osg::ref_ptr<osg::Node> model;
+  osg::BoundingSphere modelBound;
+  float switchDistance;
+  bool baked;
+  int numBakes;
+  int numVisible;
+
+  osg::ref_ptr<osg::Texture2D> atlas;
+  std::vector< osg::ref_ptr<osg::Camera> > bakeCameras;
+  osg::ref_ptr<osg::Group> bakeLights;
+  std::vector< osg::ref_ptr<osg::LightSource> > sceneLights;
+  std::vector< osg::ref_ptr<osg::Light> > bakedLights;
+  std::vector<osg::Vec3> bakedDirections;
+
+  std::vector<Instance> instances;
+  osg::BoundingBox bounds;
+  osg::ref_ptr<osg::Geometry> billboards;
+  osg::ref_ptr<osg::Vec3Array> centers;
+  osg::ref_ptr<osg::Vec2Array> atlasCoords;
+  osg::ref_ptr<osg::Vec2Array> corners;
+  osg::ref_ptr<osg::DrawArrays> quads;
+};
+
+// The dumptruck with two simplified levels, the last one is drawn up to maxRange.
+osg::LOD* createDumpTruckLOD(osg::Node* dumpTruck, float maxRange)
+{
+  //Use 
+  osgUtil::Simplifier simply(0.53);
+  simply.setMaximumLength(2); 
+  //the simplifier only changes geometry, all levels can share the textures
+  osg::CopyOp geometryCopy(osg::CopyOp::DEEP_COPY_ALL &
+                           ~(osg::CopyOp::DEEP_COPY_TEXTURES | osg::CopyOp::DEEP_COPY_IMAGES));
+  osg::ref_ptr<osg::Node> dumpTruckLower = 
+      dynamic_cast<osg::Node*>(dumpTruck->clone(geometryCopy));
+  dumpTruckLower->accept(simply); 
+
+  osg::ref_ptr<osg::Node> dumpTruckLowest = 
+      dynamic_cast<osg::Node*>(dumpTruck->clone(geometryCopy));
+  simply.setSampleRatio(.1);
+  dumpTruckLowest->accept(simply); 
+
+  osg::LOD* dumpTruckLOD = new osg::LOD();
+  dumpTruckLOD->setRangeMode( osg::LOD::DISTANCE_FROM_EYE_POINT );
+  dumpTruckLOD->addChild(dumpTruck, 0,50);
+  dumpTruckLOD->addChild(dumpTruckLower, 51,60);
+  dumpTruckLOD->addChild(dumpTruckLowest,61,maxRange);
+  return dumpTruckLOD;
+}
+
+// Renders numTrucks dumptrucks on a grid over a large terrain into an
+// offscreen pbuffer while the camera circles the terrain, once with the
+// mesh LOD only and once with impostors, and prints the frame times.
+int runImpostorBenchmark(int numTrucks)
+{
+  const int warmupFrames = 50;
+  const int measuredFrames = 300;
+  const int width = 1280;
+  const int height = 720;
+  const float truckScale = 12.0f;
+
+  osg::ref_ptr<osg::Node> dumpTruck = osgDB::readNodeFile("dumptruck.osg");
+  if(!dumpTruck.valid())
+    return 1;
+
+  osg::ref_ptr<osg::HeightField> terrain = new osg::HeightField();
+  terrain->allocate(512, 512);
+  terrain->setXInterval(20.0f);
+  terrain->setYInterval(20.0f);
+  for(unsigned int x = 0; x < terrain->getNumColumns(); x++)
+    for(unsigned int y = 0; y < terrain->getNumRows(); y++)
+      terrain->setHeight(x, y, 40.0f * (cosf(x * 0.05f) + sinf(y * 0.05f)));
+  osg::ref_ptr<osg::Geode> terrainGeode = new osg::Geode();
+  terrainGeode->addDrawable(new osg::ShapeDrawable(terrain));
+  float extent = 511 * 20.0f;
+
+  // the model sits on its lowest point
+  osg::ComputeBoundsVisitor boundsVisitor;
+  dumpTruck->accept(boundsVisitor);
+  float lift = -boundsVisitor.getBoundingBox().zMin() * truckScale;
+
+  for(int useImpostors = 0; useImpostors < 2; useImpostors++)
+  {
+    osg::ref_ptr<osg::Group> root = new osg::Group();
+    root->getOrCreateStateSet()->setMode(GL_LIGHTING, osg::StateAttribute::ON);
+    root->getOrCreateStateSet()->setMode(GL_LIGHT0, osg::StateAttribute::ON);
+    root->addChild(terrainGeode);
+
+    osg::ref_ptr<osg::LightSource> sun = new osg::LightSource();
+    sun->getLight()->setLightNum(0);
+    sun->getLight()->setPosition(osg::Vec4(0.3f, 0.5f, 1.0f, 0.0f));
+    root->addChild(sun);
+
+    osg::ref_ptr<osg::LOD> dumpTruckLOD =
+        createDumpTruckLOD(dumpTruck, useImpostors ? IMPOSTOR_DISTANCE : 10000);
+    osg::ref_ptr<Impostors> impostors;
+    if(useImpostors)
+    {
+      impostors = new Impostors(dumpTruck, IMPOSTOR_DISTANCE);
+      impostors->addLight(sun);
+      root->addChild(impostors);
+    }
+
+    int side = int(ceilf(sqrtf(float(numTrucks))));
+    for(int i = 0; i < numTrucks; i++)
+    {
+      float x = (i % side + 0.5f) * extent / side;
+      float y = (i / side + 0.5f) * extent / side;
+      osg::Vec3 position(x, y, terrain->getHeight(int(x / 20.0f), int(y / 20.0f)) + lift);
+      osg::ref_ptr<osg::PositionAttitudeTransform> transform = new osg::PositionAttitudeTransform();
+      transform->setPosition(position);
+      transform->setScale(osg::Vec3(truckScale, truckScale, truckScale));
+      transform->addChild(dumpTruckLOD);
+      root->addChild(transform);
+      if(impostors.valid())
+        impostors->addInstance(position, truckScale);
+    }
+
+    osg::ref_ptr<osg::GraphicsContext> gc = createPbuffer(width, height);
+    if(!gc.valid())
+    {
+      osg::notify(osg::FATAL) << "Could not create a pbuffer for the benchmark" << std::endl;
+      return 1;
+    }
+
+    osgViewer::Viewer viewer;
+    viewer.setSceneData(root);
+    osg::Camera* camera = viewer.getCamera();
+    camera->setGraphicsContext(gc.get());
+    camera->setViewport(0, 0, width, height);
+    camera->setProjectionMatrixAsPerspective(45.0, double(width) / height, 10.0, 40000.0);
+    viewer.setThreadingModel(osgViewer::Viewer::SingleThreaded);
+    viewer.realize();
+
+    osg::Vec3 center(extent * 0.5f, extent * 0.5f, 0.0f);
+    osg::Timer_t start = 0;
+    for(int frame = 0; frame < warmupFrames + measuredFrames; frame++)
+    {
+      if(frame == warmupFrames)
+        start = osg::Timer::instance()->tick();
+      float angle = 2.0f * osg::PI * frame / measuredFrames;
+      osg::Vec3 eye = center + osg::Vec3(cosf(angle), sinf(angle), 0.0f) * extent * 0.6f + osg::Vec3(0.0f, 0.0f, 1500.0f);
+      camera->setViewMatrixAsLookAt(eye, center, osg::Vec3(0.0f, 0.0f, 1.0f));
+      renderFrame(viewer, NULL);
+    }
+    double ms = osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick()) / measuredFrames;
+    std::cout << numTrucks << " trucks, " << (useImpostors ? "impostors" : "mesh LOD") << ": " << ms << " ms/frame";
+    if(impostors.valid())
+      std::cout << ", " << impostors->getNumVisible() << " impostors in the last frame, "
+                << impostors->getNumBakes() << " bakes";
+    std::cout << std::endl;
+  }
+  return 0;
+}
+
+/// ---
+
+// Memory ---
+
+// CPU memory of one part of the scene, textures shared between parts are
+// counted in each of them.
+void printMemory(const std::string& name, osg::Node* node)
+{
+  MemoryUsage usage = getMemoryUsage(node);
+  std::cout << name << ": " << toMegabytes(usage.cpuBytes()) << " MB - "
+            << usage.geometries << " geometries " << toMegabytes(usage.geometryBytes) << " MB, "
+            << usage.textures << " textures " << toMegabytes(usage.textureBytes) << " MB, "
+            << usage.stateSets << " state sets " << toMegabytes(usage.stateSetBytes) << " MB" << std::endl;
+}
+
+/// ---
 
 int main(int argc, char *argv[]){
   
+  // --tiled replaces the fixed function lights with tiled forward lighting,
+  // --lights N sets the number of lights and --benchmark runs the offscreen
+  // benchmark from 2 to MAX_LIGHTS lights. --no-impostors keeps the mesh
+  // LOD at every distance and --impostor-bench N compares both with N trucks
+  osg::ArgumentParser arguments(&argc, argv);
+  bool benchmark = arguments.read("--benchmark");
+  bool tiled = arguments.read("--tiled") || benchmark;
+  int numLights = 2;
+  arguments.read("--lights", numLights);
+  bool useImpostors = !arguments.read("--no-impostors");
+
+  // --build-texture-cache writes the compressed textures and exits
+  if(arguments.read("--build-texture-cache"))
+  {
+    std::vector<std::string> files;
+    files.push_back("ground.png");
+    files.push_back("cessna.osg");
+    files.push_back("dumptruck.osg");
+    return buildTextureCache(files);
+  }
+  // --no-texture-cache is the reference for the texture memory and upload stalls
+  bool useTextureCache = !arguments.read("--no-texture-cache");
+  osg::ref_ptr<CachedImageReadCallback> imageCache = new CachedImageReadCallback();
+  if(useTextureCache)
+    osgDB::Registry::instance()->setReadFileCallback(imageCache.get());
+
+  int impostorTrucks = 0;
+  if(arguments.read("--impostor-bench", impostorTrucks))
+    return runImpostorBenchmark(impostorTrucks);
+
   osg::ref_ptr<osg::Group> root = new osg::Group;
   osg::StateSet* state = root->getOrCreateStateSet();
   state->setMode( GL_LIGHTING, osg::StateAttribute::ON );
@@ -87,6 +1475,8 @@ int main(int argc, char *argv[]){
   osg::ref_ptr<osg::Geode> lineGeode = new osg::Geode();
   lineGeode->addDrawable(linesGeom);
   lineGeode->getOrCreateStateSet()->setMode(GL_LIGHTING,osg::StateAttribute::OFF);
+  // an empty program keeps the line in fixed function when tiled lighting is on
+  lineGeode->getOrCreateStateSet()->setAttributeAndModes(new osg::Program());
   
   root->addChild(lineGeode);
   
@@ -116,7 +1506,7 @@ int main(int argc, char *argv[]){
   osg::ref_ptr<osg::Geode> geoGround = new osg::Geode();
   geoGround->addDrawable(new osg::ShapeDrawable(ground));
   geoGround->getOrCreateStateSet()->setTextureAttributeAndModes(0, groundTexture);
-  root->addChild(geoGround);
+  addWhenUploaded(root, geoGround);
  
   //Load Plane, give it a animation Path
   osg::ref_ptr<osg::Node> cessna = osgDB::readNodeFile("cessna.osg");
@@ -137,29 +1527,13 @@ int main(int argc, char *argv[]){
   planePath->setLoopMode( osg::AnimationPath::SWING );
   osg::ref_ptr<osg::AnimationPathCallback> planecb = new osg::AnimationPathCallback(planePath);
   cessnaTransform->setUpdateCallback(planecb);
-  root->addChild(cessnaTransform);
+  addWhenUploaded(root, cessnaTransform);
  
 
-  //Create dumptruck with LODs
+  //Create dumptruck with LODs, past IMPOSTOR_DISTANCE it is an impostor
   osg::ref_ptr<osg::Node> dumpTruck = osgDB::readNodeFile("dumptruck.osg");
-
-  //Use 
-  osgUtil::Simplifier simply(0.53);
-  simply.setMaximumLength(2); 
-  osg::ref_ptr<osg::Node> dumpTruckLower = 
-      dynamic_cast<osg::Node*>(dumpTruck->clone(osg::CopyOp::DEEP_COPY_ALL));
-  dumpTruckLower->accept(simply); 
-
-  osg::ref_ptr<osg::Node> dumpTruckLowest = 
-      dynamic_cast<osg::Node*>(dumpTruck->clone(osg::CopyOp::DEEP_COPY_ALL));
-  simply.setSampleRatio(.1);
-  dumpTruckLowest->accept(simply); 
-
-  osg::ref_ptr<osg::LOD> dumpTruckLOD = new osg::LOD();
-  dumpTruckLOD->setRangeMode( osg::LOD::DISTANCE_FROM_EYE_POINT );
-  dumpTruckLOD->addChild(dumpTruck, 0,50);
-  dumpTruckLOD->addChild(dumpTruckLower, 51,60);
-  dumpTruckLOD->addChild(dumpTruckLowest,61,10000);
+  osg::ref_ptr<osg::LOD> dumpTruckLOD =
+      createDumpTruckLOD(dumpTruck, useImpostors ? IMPOSTOR_DISTANCE : 10000);
   
   
   osg::ref_ptr<osg::PositionAttitudeTransform> dumpTruckTransform = 
@@ -168,7 +1542,14 @@ int main(int argc, char *argv[]){
   dumpTruckTransform->addChild(dumpTruckLOD);
   dumpTruckTransform->setPosition(osg::Vec3(128*5,128*5,64));
   dumpTruckTransform->setScale(osg::Vec3(12,12,12));
-  root->addChild(dumpTruckTransform);
+  addWhenUploaded(root, dumpTruckTransform);
+
+  osg::ref_ptr<Impostors> impostors;
+  if(useImpostors)
+  {
+    impostors = new Impostors(dumpTruck, IMPOSTOR_DISTANCE);
+    impostors->addInstance(dumpTruckTransform->getPosition(), 12);
+  }
   
   // Add Light
   osg::ref_ptr<osg::LightSource> lightS = new osg::LightSource();
@@ -200,6 +1581,11 @@ int main(int argc, char *argv[]){
   light2T->setUpdateCallback(lightAnimC);
   light2T->addChild(light2S);
   root->addChild(light2T);
+  if(impostors.valid())
+  {
+    impostors->addLight(lightS);
+    impostors->addLight(light2S);
+  }
  
   //Setup intersection callback via node
   osg::ref_ptr<osgUtil::LineSegmentIntersector> intersector = 
@@ -210,13 +1596,64 @@ int main(int argc, char *argv[]){
   root->setUserData(new IntersectRef(iv, light));
   root->addUpdateCallback(icb);
 
+  osg::ref_ptr<TiledLighting> tiledLighting;
+  if(tiled)
+  {
+    tiledLighting = new TiledLighting(root, light, light2, light2T);
+    tiledLighting->setNumLights(numLights);
+  }
+
   // Optimizes the scene-graph
   osgUtil::Optimizer optimizer;
   optimizer.optimize(root);
+  // added after the optimizer, the billboard arrays change every frame
+  if(impostors.valid())
+    root->addChild(impostors);
+
+  // the whole scene, including the parts waiting for their uploads
+  osg::ref_ptr<osg::Group> fullScene = new osg::Group();
+  fullScene->addChild(root);
+  for(size_t i = 0; i < pendingUploads.size(); i++)
+  {
+    optimizer.optimize(pendingUploads[i].second.get());
+    fullScene->addChild(pendingUploads[i].second.get());
+  }
+  printMemory("ground", geoGround);
+  printMemory("cessna", cessnaTransform);
+  printMemory("dumptruck LOD", dumpTruckLOD);
+  if(impostors.valid())
+    printMemory("impostors", impostors);
+  printMemory("scene", fullScene);
+  printTextureMemory(fullScene, imageCache->cachedImages);
+  osg::BoundingSphere bound = fullScene->getBound();
+  fullScene = NULL;
   
   // Set up the viewer and add the scene-graph root
   osgViewer::Viewer viewer;
  
   viewer.setSceneData(root);
-  return viewer.run();
+  if(benchmark)
+    return runLightBenchmark(viewer, tiledLighting);
+
+  // home on the whole scene, not only the parts that are uploaded at start
+  osg::ref_ptr<osgGA::TrackballManipulator> manipulator = new osgGA::TrackballManipulator();
+  manipulator->setAutoComputeHomePosition(false);
+  manipulator->setHomePosition(bound.center() - osg::Vec3(0.0f, 3.5f * bound.radius(), 0.0f),
+                               bound.center(), osg::Vec3(0.0f, 0.0f, 1.0f));
+  viewer.setCameraManipulator(manipulator);
+  viewer.realize();
+
+  osg::ref_ptr<osgUtil::IncrementalCompileOperation> ico;
+  if(useTextureCache)
+    ico = startUploads(viewer);
+  else
+    attachUploads();
+  UploadStats uploadStats;
+  while(!viewer.done())
+  {
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    renderFrame(viewer, tiledLighting);
+    uploadStats.frame(ico, osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick()));
+  }
+  return 0;
 }
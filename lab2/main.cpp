@@ -3,16 +3,63 @@
 
 #include <osgViewer/Viewer>
 #include <osgDB/ReadFile>
+#include <osgDB/FileUtils>
 #include <osg/MatrixTransform>
 
 #include <osg/ComputeBoundsVisitor>
 #include <osg/Material>
+#include <osg/OcclusionQueryNode>
+#include <osgViewer/Renderer>
+#include <osgUtil/Statistics>
+#include <osgText/Text>
 #include <glm/gtx/matrix_interpolation.hpp>
 
+#include "MemoryVisitor.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
 sgct::Engine * gEngine;
 
-#define WAND_SENSOR_IDX 0
-#define HEAD_SENSOR_IDX 1
+#define MAX_WANDS 16               //tracked wands plus benchmark wands
+
+//models that can be picked and moved with the wand
+#define NUM_MODELS 2
+#define MODEL_IDX 0
+#define CESSNA_IDX 1
+
+//model highlight synced to all nodes
+#define HIGHLIGHT_NONE 0
+#define HIGHLIGHT_POINTED 1
+#define HIGHLIGHT_HELD 2
+
+//fixed rate simulation on the master
+#define SIM_DT (1.0/60.0)          //seconds per simulation step
+#define SIM_MAX_STEPS 4            //steps per frame before the simulation is allowed to fall behind
+
+//culling settings
+#define SMALL_FEATURE_PIXELS 4.0f  //objects smaller than this on screen are skipped
+#define OCCLUSION_PIXELS 50        //visible pixels needed before an occlusion query passes
+#define OCCLUSION_FRAMES 3         //frames a query result is reused before a new query is issued
+#define STATS_INTERVAL 300         //frames between culling reports
+
+//single pass stereo - both eyes are drawn from one cull traversal
+#define STEREO_BENCH_FRAMES 600    //frames per mode in the stereo benchmark
+
+//text overlay
+#define HUD_NODE_MASK 0x2          //keeps the overlay out of wand intersections
+#define HUD_FONT_SIZE 12
+#define TEXT_BENCH_FRAMES 300      //frames per line count and text path in the text benchmark
+#define TEXT_BENCH_STEPS 3         //10, 100 and 1000 extra lines
+
+//memory accounting
+#define MEMORY_LOG_INTERVAL 1800       //frames between memory reports
+#define SCENE_MEMORY_BUDGET_MB 1024.0  //cpu memory the scene graph may use on a node
+#define MODEL_MEMORY_BUDGET_MB 512.0   //cpu memory a single model may use
+#define GPU_MEMORY_BUDGET_MB 1024.0    //buffers and textures per graphics context
 
 // OSG stuff
 
@@ -21,11 +68,17 @@ sgct::Engine * gEngine;
 
 			root    <- root of scene
 			 |
-			 |------ wand  <- geode for wand
+			 |------ wand  <- geode with one line per tracked wand
+			 |
+			 |------ mHudCamera  <- orthographic overlay with the tracker text
+		     |
+		 occlusion  <- occlusion query node for the whole scene
 		     |
 		mSceneTrans <- used to move the world around - in this code user movement is actually the world moving in the opposite direction
 			/ \
 		   /   \	
+    occlusion   occlusion <- occlusion query nodes for each model
+     |				|
  mCessnaTrans   mModelTrans <- transform nodes for the models
      |				|
 mCessnaModel      mModel   <- model nodes with geometry ata and material attributes
@@ -35,12 +88,170 @@ mCessnaModel      mModel   <- model nodes with geometry ata and material attribu
 osgViewer::Viewer * mViewer;
 osg::ref_ptr<osg::Group> mRootNode;
 osg::ref_ptr<osg::MatrixTransform> mSceneTrans;
+osg::ref_ptr<osg::MatrixTransform> mModelTrans;
+osg::ref_ptr<osg::MatrixTransform> mCessnaTrans;
 osg::ref_ptr<osg::FrameStamp> mFrameStamp; //to sync osg animations across cluster
 osg::ref_ptr<osg::Geometry> linesGeom;
-osg::ref_ptr<osgUtil::LineSegmentIntersector> wandLine;
 osg::ref_ptr<osg::Node> mCessnaModel;
 osg::ref_ptr<osg::Node> mModel;
-osg::ref_ptr<osg::Node> intersectedNode; //
+
+//state produced by one simulation step, render nodes interpolate between two of them
+struct SimSnapshot
+{
+  double time = 0.0;
+  glm::mat4 scene;
+  glm::mat4 models[NUM_MODELS];
+  int highlight[NUM_MODELS] = {};
+};
+
+//one entry per tracking device, built once at init so the trackers are not walked every frame
+struct DeviceEntry
+{
+  sgct::SGCTTrackingDevice * device;
+  size_t tracker;
+  size_t index;     //device index on the tracker
+  int sensor;       //index in sharedTransforms, -1 without a sensor
+  int firstButton;  //index of the first button in sharedButton
+  int numButtons;
+};
+
+//interaction state of one wand, only used by the simulation on the master
+struct WandState
+{
+  int sensor;       //index in sharedTransforms, -1 for the keyboard and benchmark wands
+  int head;         //head sensor of the user holding the wand, -1 without head tracking
+  int firstButton;
+  int numButtons;
+  glm::mat4 matrix;
+  glm::mat4 startMat;
+  glm::vec3 startPos;
+  bool point;
+  bool crosshair;
+  bool selecting;
+  bool moving;
+  int scaling;
+  int hit;          //model under the ray this step, -1 for none
+  int picked;       //model pointed at or held, -1 for none
+  osg::ref_ptr<osgUtil::LineSegmentIntersector> ray;
+};
+
+std::vector<DeviceEntry> mDevices;
+std::vector<WandState> mWands;
+size_t numUserWands = 0;   //wands held by users, the rest are benchmark wands
+int grabbedBy[NUM_MODELS]; //wand holding each model, -1 if free
+double pickTime = 0.0;
+unsigned int pickSteps = 0;
+
+//picking workers, started once and woken for every simulation step
+std::vector<std::thread> mPickWorkers;
+std::mutex pickMutex;
+std::condition_variable pickStart;
+std::condition_variable pickDone;
+size_t pickStride = 1;          //threads picking this step, the simulation thread included
+size_t pickNext = 1;            //next share of the wands that a worker can take
+size_t pickPending = 0;
+bool pickStop = false;
+
+//simulation state, only advanced on the master
+osg::Matrix mSimScene;
+osg::Matrix mSimModels[NUM_MODELS];
+double simTime = 0.0;
+double simLastTime = 0.0;
+double simAccumulator = 0.0;
+
+//counts the models that survive frustum, small feature and occlusion culling
+class CullCounter : public osg::NodeCallback
+{
+public:
+  CullCounter() : drawn(0) {}
+
+  virtual void operator()(osg::Node* node, osg::NodeVisitor* nv)
+  {
+    drawn++;
+    traverse(node, nv);
+  }
+
+  unsigned int drawn;
+};
+
+osg::ref_ptr<osg::Camera> mHudCamera;
+osg::ref_ptr<osgText::Text> mHudText;
+std::string hudString;
+int benchmarkLines = 0;    //extra text lines, only used on the master
+
+//text benchmark, the phase is 0 when off, then two phases per line count,
+//first with the cached overlay and then with sgct_text::print
+unsigned int textBenchFrames = 0;
+int lastTextBenchPhase = 0;
+int textBenchLines = 0;         //settings from before the benchmark
+bool textBenchOverlay = true;
+double textBenchTime[TEXT_BENCH_STEPS * 2 + 1] = {};
+unsigned int textBenchCount[TEXT_BENCH_STEPS * 2 + 1] = {};
+
+std::vector< osg::ref_ptr<CullCounter> > mCullCounters;
+std::vector< osg::ref_ptr<osg::OcclusionQueryNode> > mOcclusionNodes;
+unsigned int cullTraversals = 0;
+unsigned int drawnDrawables = 0;
+
+//projection used by all render leaves when both eyes share one cull traversal
+osg::ref_ptr<osg::RefMatrix> mEyeProjection;
+bool shareEyeCull = false;
+const void * culledViewport = NULL;
+unsigned int culledFrame = 0;
+unsigned int sharedEyeDraws = 0;
+double drawTime = 0.0;
+
+//stereo benchmark, the phase is 0 when off, 1 for single pass and 2 for one cull per eye
+unsigned int stereoBenchFrames = 0;
+int lastStereoBenchPhase = 0;
+bool stereoBenchSinglePass = true; //mode chosen with M before the benchmark
+double stereoBenchTime[3] = {};
+unsigned int stereoBenchCount[3] = {};
+
+//redirects the culled render graph to mEyeProjection right before it is drawn
+class EyeProjectionCallback : public osg::Camera::DrawCallback
+{
+public:
+  virtual void operator()(osg::RenderInfo& renderInfo) const
+  {
+    if( !shareEyeCull ) return;
+
+    osgViewer::Renderer * renderer = dynamic_cast<osgViewer::Renderer*>(renderInfo.getCurrentCamera()->getRenderer());
+    redirect( renderer->getSceneView(0)->getRenderStage() );
+
+    //the state caches the last projection pointer, force a reload for the new eye
+    renderInfo.getState()->applyProjectionMatrix( NULL );
+  }
+
+protected:
+  void redirect(osgUtil::RenderBin * bin) const
+  {
+    osgUtil::RenderBin::StateGraphList & graphs = bin->getStateGraphList();
+    for( size_t i = 0; i < graphs.size(); i++ )
+      for( size_t j = 0; j < graphs[i]->_leaves.size(); j++ )
+        graphs[i]->_leaves[j]->_projection = mEyeProjection;
+
+    //depth sorted bins move their leaves out of the state graphs
+    osgUtil::RenderBin::RenderLeafList & leaves = bin->getRenderLeafList();
+    for( size_t i = 0; i < leaves.size(); i++ )
+      leaves[i]->_projection = mEyeProjection;
+
+    osgUtil::RenderBin::RenderBinList & bins = bin->getRenderBinList();
+    for( osgUtil::RenderBin::RenderBinList::iterator it = bins.begin(); it != bins.end(); ++it )
+      redirect( it->second.get() );
+  }
+};
+
+//per node budgets that are checked in every memory report
+struct MemoryBudget
+{
+  std::string name;
+  osg::ref_ptr<osg::Node> node;
+  double megabytes;
+};
+
+std::vector<MemoryBudget> mMemoryBudgets;
+double lastMemoryTotal = 0.0;
 
 //-----------------------
 // function declarations
@@ -57,25 +268,59 @@ void myDecodeFun();
 
 void initOSG();
 void createOSGScene();
+osg::Node * loadModel(const std::string & file, osg::MatrixTransform * trans, float offsetX, double size);
+void createTextOverlay();
+void updateTextOverlay();
 void setupLightSource();
+void setupCulling();
+void drawSharedEye();
+void buildDeviceRegistry();
+void addWand(int sensor, int head, int firstButton, int numButtons);
+void setBenchmarkWands(size_t count);
+void getWandRay(const glm::mat4 & matrix, osg::Vec3 & start, osg::Vec3 & end);
+void runSimulation();
+void simulationStep();
+SimSnapshot takeSnapshot();
+void readWandInput(WandState & wand, size_t idx);
+void navigate(WandState & wand);
 void calculateIntersections();
+void intersectWands(size_t first, size_t stride);
+void startPickWorkers();
+void stopPickWorkers();
+void pickWorker();
+void manipulate(WandState & wand, size_t idx);
+void updateHighlight(const int * highlight);
+osg::Node * getModel(int idx);
+osg::MatrixTransform * getModelTrans(int idx);
+glm::mat4 toGlm(const osg::Matrix & m);
+osg::Matrix interpolateMatrix(const glm::mat4 & from, const glm::mat4 & to, float t);
+void collectCullStats();
+void printCullStats();
+float getStereoCullMargin();
+void updateStereoBenchmark();
+void setTextBenchPhase(int phase);
+void updateTextBenchmark();
+bool fitsMemoryBudget(const std::string & name, double size, double megabytes);
+bool checkFileBudget(const std::string & file, double megabytes);
+bool checkMemoryBudget(const std::string & name, osg::Node * node, double megabytes);
+void setMemoryBudget(const std::string & name, osg::Node * node, double megabytes);
+void printMemoryStats();
 
 osg::Vec3d wand_start(0,-1,0);
 osg::Vec3d wand_end(0,0,0);
-glm::mat4 wand_matrix;
-glm::mat4 head_matrix;
-glm::vec3 wand_startPos;
-glm::mat4 wand_startMat;
-
-bool selecting;
-int scaling;
-bool intersecting;
-bool moving;
 //store each device's transform 4x4 matrix in a shared vector
 sgct::SharedDouble curr_time(0.0);
 sgct::SharedVector<glm::mat4> sharedTransforms;
 sgct::SharedVector<bool> sharedButton;
+sgct::SharedVector<int> sharedWandSensors;
 sgct::SharedString sharedText;
+sgct::SharedObject<SimSnapshot> sharedSimPrevious;
+sgct::SharedObject<SimSnapshot> sharedSimCurrent;
+sgct::SharedFloat sharedSimAlpha(0.0f);
+sgct::SharedBool sharedSinglePassStereo(true);
+sgct::SharedInt sharedStereoBench(0);
+sgct::SharedBool sharedTextOverlay(true);
+sgct::SharedInt sharedTextBench(0);
 
 int main( int argc, char* argv[] ){
   // Allocate
@@ -112,31 +357,25 @@ void myInitOGLFun(){
   initOSG();
   createOSGScene();
   setupLightSource();
+  setupCulling();
 
   glEnable(GL_DEPTH_TEST);
-  //set intial values for selecting and scaling
-  selecting = false;
-  scaling = false;
 
   //only store the tracking data on the master node
   if( !gEngine->isMaster() ) return;
 
-  for(size_t i = 0; i < sgct::Engine::getTrackingManager()->getNumberOfTrackers(); i++){
-    sgct::SGCTTracker * trackerPtr = sgct::Engine::getTrackingManager()->getTrackerPtr(i);
+  //the simulation starts from the scene as it was loaded
+  mSimScene = mSceneTrans->getMatrix();
+  for( int i = 0; i < NUM_MODELS; i++ )
+    if( getModel(i) )
+      mSimModels[i] = getModelTrans(i)->getMatrix();
+  simLastTime = sgct::Engine::getTime();
 
-    for(size_t j=0; j<trackerPtr->getNumberOfDevices(); j++){
-      sgct::SGCTTrackingDevice * devicePtr = trackerPtr->getDevicePtr(j);
+  buildDeviceRegistry();
 
-      if( devicePtr->hasSensor() ){
-        sharedTransforms.addVal( glm::mat4(1.0f) );
-      }
-      if( devicePtr->hasButtons() ){
-        for( int idx = 0 ; idx < devicePtr->getNumberOfButtons() ; ++idx ){
-          sharedButton.addVal(0);
-        }
-      }
-    }
-  }
+  //both snapshots start at the loaded pose so the first frames interpolate valid matrices
+  sharedSimCurrent.setVal( takeSnapshot() );
+  sharedSimPrevious.setVal( sharedSimCurrent.getVal() );
 }
 
 void myPreSyncFun(){
@@ -148,271 +387,672 @@ void myPreSyncFun(){
 
   std::stringstream message;
 
-  size_t index = 0;
-  for(size_t i = 0; i < sgct::Engine::getTrackingManager()->getNumberOfTrackers(); i++){
-    sgct::SGCTTracker * trackerPtr = sgct::Engine::getTrackingManager()->getTrackerPtr(i);
-
-    for(size_t j = 0; j < trackerPtr->getNumberOfDevices(); j++){
-      sgct::SGCTTrackingDevice * devicePtr = trackerPtr->getDevicePtr(j);
-
-      message << "Device " << i << " on tracker " << j << std::endl;
-
-      if( devicePtr->hasSensor() ){
-        sharedTransforms.setValAt( index, devicePtr->getWorldTransform() );
-        message << "Position:" << std::endl << "  "
-                << devicePtr->getPosition().x << ", "
-                << devicePtr->getPosition().y << ", "
-                << devicePtr->getPosition().z << std::endl;
-        message << "Euler angles:" << std::endl << "  "
-                << devicePtr->getEulerAngles().x << ", "
-                << devicePtr->getEulerAngles().y << ", "
-                << devicePtr->getEulerAngles().z << std::endl;
-        index++;
-
-      }
-
-      if( devicePtr->hasButtons() ){
-        message << "Buttons:" << std::endl << "  ";
-        for( int idx = 0 ; idx < devicePtr->getNumberOfButtons() ; ++idx ){
-          message << devicePtr->getButton(idx) ? "1" : "0";
-          sharedButton.setValAt(idx, devicePtr->getButton(idx));
+  for(size_t i = 0; i < mDevices.size(); i++){
+    const DeviceEntry & entry = mDevices[i];
+    sgct::SGCTTrackingDevice * devicePtr = entry.device;
+
+    message << "Device " << entry.index << " on tracker " << entry.tracker << std::endl;
+
+    if( entry.sensor >= 0 ){
+      sharedTransforms.setValAt( entry.sensor, devicePtr->getWorldTransform() );
+      message << "Position:" << std::endl << "  "
+              << devicePtr->getPosition().x << ", "
+              << devicePtr->getPosition().y << ", "
+              << devicePtr->getPosition().z << std::endl;
+      message << "Euler angles:" << std::endl << "  "
+              << devicePtr->getEulerAngles().x << ", "
+              << devicePtr->getEulerAngles().y << ", "
+              << devicePtr->getEulerAngles().z << std::endl;
+    }
 
-        }
-        message << std::endl;
+    if( entry.numButtons > 0 ){
+      message << "Buttons:" << std::endl << "  ";
+      for( int idx = 0 ; idx < entry.numButtons ; ++idx ){
+        message << (devicePtr->getButton(idx) ? "1" : "0");
+        sharedButton.setValAt(entry.firstButton + idx, devicePtr->getButton(idx));
       }
+      message << std::endl;
+    }
 
-      if( devicePtr->hasAnalogs() ){
-        message << "Analogs:" << std::endl << "  ";
-        for( int idx = 0 ; idx < devicePtr->getNumberOfAxes() ; ++idx ){
-          message << "  " << devicePtr->getAnalog(idx) << std::endl;
-        }
+    if( devicePtr->hasAnalogs() ){
+      message << "Analogs:" << std::endl << "  ";
+      for( int idx = 0 ; idx < devicePtr->getNumberOfAxes() ; ++idx ){
+        message << "  " << devicePtr->getAnalog(idx) << std::endl;
       }
-      message << std::endl;
     }
+    message << std::endl;
   }
 
+  //step the text benchmark through its line counts and both text paths
+  if( sharedTextBench.getVal() > 0 && ++textBenchFrames >= TEXT_BENCH_FRAMES ){
+    textBenchFrames = 0;
+    setTextBenchPhase( sharedTextBench.getVal() < TEXT_BENCH_STEPS * 2 ? sharedTextBench.getVal() + 1 : 0 );
+  }
+
+  //extra static lines to measure the cost of the text overlay
+  for( int i = 0; i < benchmarkLines; i++ )
+    message << "Benchmark line " << i << std::endl;
+
   sharedText.setVal(message.str());
+
+  //switch the stereo benchmark to the next mode
+  if( sharedStereoBench.getVal() > 0 && ++stereoBenchFrames >= STEREO_BENCH_FRAMES ){
+    stereoBenchFrames = 0;
+    sharedStereoBench.setVal( sharedStereoBench.getVal() == 1 ? 2 : 0 );
+    //back to the mode the user had once the benchmark is over
+    sharedSinglePassStereo.setVal( sharedStereoBench.getVal() == 0 ? stereoBenchSinglePass : false );
+  }
+
+  runSimulation();
 }
 
 void myPostSyncPreDrawFun(){
+  //render between the two latest simulation snapshots, so movement and animation
+  //look the same no matter how fast this node draws
+  const SimSnapshot & previous = sharedSimPrevious.getVal();
+  const SimSnapshot & current = sharedSimCurrent.getVal();
+  float alpha = sharedSimAlpha.getVal();
+  double renderTime = previous.time + alpha * (current.time - previous.time);
+
   //update the frame stamp in the viewer to sync all
   //time based events in osg
   mFrameStamp->setFrameNumber( gEngine->getCurrentFrameNumber() );
   mFrameStamp->setReferenceTime( curr_time.getVal() );
-  mFrameStamp->setSimulationTime( curr_time.getVal() );
+  mFrameStamp->setSimulationTime( renderTime );
   mViewer->setFrameStamp( mFrameStamp.get() );
-  mViewer->advance( curr_time.getVal() ); //update
+  mViewer->advance( renderTime ); //update
+
+  if( gEngine->getCurrentFrameNumber() % STATS_INTERVAL == 0 )
+    printCullStats();
+  updateStereoBenchmark();
+  updateTextBenchmark();
+  if( gEngine->getCurrentFrameNumber() % MEMORY_LOG_INTERVAL == 0 )
+    printMemoryStats();
+
+  updateTextOverlay();
+
+  // Draw one line per tracked wand in OSG
+  osg::Vec3Array* vertices = new osg::Vec3Array();
+  for( size_t i = 0; i < sharedWandSensors.getSize(); i++ ){
+    int sensor = sharedWandSensors.getValAt(i);
+    if( sensor < 0 || sensor >= static_cast<int>(sharedTransforms.getSize()) ) continue;
+
+    osg::Vec3 start, end;
+    getWandRay( sharedTransforms.getValAt(sensor), start, end );
+    vertices->push_back(start);
+    vertices->push_back(end);
+  }
+  if( vertices->empty() ){
+    //Debug drawing for wand even if there is no VRPN server
+    vertices->push_back(wand_start);
+    vertices->push_back(wand_end);
+  }
+  static_cast<osg::DrawArrays*>(linesGeom->getPrimitiveSet(0))->setCount(vertices->size());
+  linesGeom->setVertexArray(vertices);
+
+  //nothing has been simulated yet
+  if( current.time > 0.0 ){
+    mSceneTrans->setMatrix( interpolateMatrix( previous.scene, current.scene, alpha ) );
+    for( int i = 0; i < NUM_MODELS; i++ )
+      getModelTrans(i)->setMatrix( interpolateMatrix( previous.models[i], current.models[i], alpha ) );
+    updateHighlight( current.highlight );
+  }
+
+  //traverse if there are any tasks to do
+  if (!mViewer->done()){
+    mViewer->eventTraversal();
+    mViewer->updateTraversal();
+  }
+}
+
+void buildDeviceRegistry(){
+  sgct::SGCTTrackingManager * trackingManager = sgct::Engine::getTrackingManager();
+  int numSensors = 0;
+  int numButtons = 0;
+
+  for(size_t i = 0; i < trackingManager->getNumberOfTrackers(); i++){
+    sgct::SGCTTracker * trackerPtr = trackingManager->getTrackerPtr(i);
 
-  bool point = false;
-  bool crosshair = false;
+    for(size_t j = 0; j < trackerPtr->getNumberOfDevices(); j++){
+      DeviceEntry entry;
+      entry.device = trackerPtr->getDevicePtr(j);
+      entry.tracker = i;
+      entry.index = j;
+      entry.sensor = entry.device->hasSensor() ? numSensors++ : -1;
+      entry.firstButton = numButtons;
+      entry.numButtons = entry.device->hasButtons() ? entry.device->getNumberOfButtons() : 0;
+      numButtons += entry.numButtons;
+      mDevices.push_back(entry);
+    }
+  }
+
+  for( int i = 0; i < numSensors; i++ )
+    sharedTransforms.addVal( glm::mat4(1.0f) );
+  for( int i = 0; i < numButtons; i++ )
+    sharedButton.addVal( false );
+
+  //sensors with buttons are wands and sensors without are heads,
+  //the n:th wand belongs to the user wearing the n:th head
+  std::vector<int> heads;
+  for( size_t i = 0; i < mDevices.size(); i++ )
+    if( mDevices[i].sensor >= 0 && mDevices[i].numButtons == 0 )
+      heads.push_back( mDevices[i].sensor );
+
+  for( size_t i = 0; i < mDevices.size() && mWands.size() < MAX_WANDS; i++ ){
+    const DeviceEntry & entry = mDevices[i];
+    if( entry.sensor >= 0 && entry.numButtons > 0 ){
+      int head = mWands.size() < heads.size() ? heads[mWands.size()] : -1;
+      addWand( entry.sensor, head, entry.firstButton, entry.numButtons );
+    }
+  }
+
+  //buttons on a separate device or no tracking at all - one user with
+  //the wand on the first sensor and the head on the second
+  if( mWands.empty() )
+    addWand( numSensors > 0 ? 0 : -1, numSensors > 1 ? 1 : -1, 0, numButtons );
+
+  numUserWands = mWands.size();
+  for( int i = 0; i < NUM_MODELS; i++ )
+    grabbedBy[i] = -1;
+
+  for( size_t i = 0; i < mWands.size(); i++ )
+    if( mWands[i].sensor >= 0 )
+      sharedWandSensors.addVal( mWands[i].sensor );
+
+  startPickWorkers();
+
+  sgct::MessageHandler::instance()->print("%u tracking devices, %u wands\n",
+                                          static_cast<unsigned int>(mDevices.size()),
+                                          static_cast<unsigned int>(mWands.size()));
+}
+
+void addWand(int sensor, int head, int firstButton, int numButtons){
+  WandState wand;
+  wand.sensor = sensor;
+  wand.head = head;
+  wand.firstButton = firstButton;
+  wand.numButtons = numButtons;
+  wand.matrix = glm::mat4(1.0f);
+  wand.startMat = glm::mat4(1.0f);
+  wand.startPos = glm::vec3(0.0f);
+  wand.point = false;
+  wand.crosshair = false;
+  wand.selecting = false;
+  wand.moving = false;
+  wand.scaling = 0;
+  wand.hit = -1;
+  wand.picked = -1;
+  wand.ray = new osgUtil::LineSegmentIntersector(wand_start, wand_end);
+  mWands.push_back(wand);
+}
+
+//extra wands without buttons that only test intersections, to measure the picking cost
+void setBenchmarkWands(size_t count){
+  if( numUserWands + count > MAX_WANDS )
+    count = MAX_WANDS - numUserWands;
+
+  mWands.resize( numUserWands );
+  for( size_t i = 0; i < count; i++ )
+    addWand( -1, -1, 0, 0 );
+
+  pickTime = 0.0;
+  pickSteps = 0;
+  sgct::MessageHandler::instance()->print("Picking with %u wands\n", static_cast<unsigned int>(mWands.size()));
+}
+
+void getWandRay(const glm::mat4 & matrix, osg::Vec3 & start, osg::Vec3 & end){
+  glm::vec3 wand_position = glm::vec3(matrix*glm::vec4(0,0,0,1));
+  //glm::quat wand_orientation = glm::quat_cast(matrix);
+  glm::mat3 wand_orientation = glm::mat3(matrix);
+
+  glm::vec3 wandEnd = wand_position + wand_orientation * glm::vec3(0,0,-10);
+  start = osg::Vec3(wand_position.x, wand_position.y, wand_position.z);
+  end = osg::Vec3(wandEnd.x, wandEnd.y, wandEnd.z);
+}
+
+void runSimulation(){
+  //catch up with the wall clock in fixed steps, a slow frame runs a few steps
+  //and the rest is left for the following frames
+  double now = sgct::Engine::getTime();
+  simAccumulator += now - simLastTime;
+  simLastTime = now;
+
+  int steps = 0;
+  while( simAccumulator >= SIM_DT && steps < SIM_MAX_STEPS ){
+    simulationStep();
+    simTime += SIM_DT;
+    simAccumulator -= SIM_DT;
+    steps++;
+
+    //render nodes interpolate between the last two steps
+    sharedSimPrevious.setVal( sharedSimCurrent.getVal() );
+    sharedSimCurrent.setVal( takeSnapshot() );
+  }
+  //the backlog is bounded so a long stall does not make the simulation run fast for seconds
+  if( simAccumulator > SIM_MAX_STEPS * SIM_DT )
+    simAccumulator = SIM_MAX_STEPS * SIM_DT;
+
+  //with a backlog the render nodes show the latest step until it is caught up
+  sharedSimAlpha.setVal( static_cast<float>( std::min( simAccumulator / SIM_DT, 1.0 ) ) );
+}
+
+SimSnapshot takeSnapshot(){
+  SimSnapshot snapshot;
+  snapshot.time = simTime;
+  snapshot.scene = toGlm( mSimScene );
+  for( int i = 0; i < NUM_MODELS; i++ ){
+    snapshot.models[i] = toGlm( mSimModels[i] );
+    snapshot.highlight[i] = grabbedBy[i] >= 0 ? HIGHLIGHT_HELD : HIGHLIGHT_NONE;
+  }
+  //benchmark wands only measure picking and do not change what the nodes show
+  for( size_t i = 0; i < numUserWands; i++ ){
+    int picked = mWands[i].picked;
+    if( picked >= 0 && snapshot.highlight[picked] == HIGHLIGHT_NONE )
+      snapshot.highlight[picked] = HIGHLIGHT_POINTED;
+  }
+  return snapshot;
+}
+
+bool getWandButton(const WandState & wand, int idx){
+  return idx < wand.numButtons && sharedButton.getValAt(wand.firstButton + idx);
+}
+
+void readWandInput(WandState & wand, size_t idx){
+  wand.point = false;
+  wand.crosshair = false;
 
   //Update position if button is pressed
-  if(sharedButton.getSize()) {
-    if(sharedButton.getValAt(0)) {
+  if(wand.numButtons > 0) {
+    if(getWandButton(wand, 0)) {
        //point mode
-       point = true;
-	   moving = true;
+       wand.point = true;
+	   wand.moving = true;
     }
-    else if(sharedButton.getValAt(1)) {
+    else if(getWandButton(wand, 1)) {
        //crosshair mode
-       crosshair = true;
-	   moving = true;
+       wand.crosshair = true;
+	   wand.moving = true;
     }
-    else if(sharedButton.getValAt(2)) {
+    else if(getWandButton(wand, 2)) {
       //Selection of model
-      selecting = true;
-	  if (sharedButton.getValAt(4)) {
+      wand.selecting = true;
+	  if (getWandButton(wand, 4)) {
 		  //scaling of model
-		  scaling = 1;
+		  wand.scaling = 1;
 	  }
-	  else if (sharedButton.getValAt(5)) {
+	  else if (getWandButton(wand, 5)) {
 		  //scaling of model
-		  scaling = -1;
+		  wand.scaling = -1;
 	  }
 	  else {
-		  scaling = 0;
+		  wand.scaling = 0;
 	  }
     }
     else {
-	  scaling = 0;
-	  selecting = false;
-	  moving = false;
+	  wand.scaling = 0;
+	  wand.selecting = false;
+	  wand.moving = false;
     }
   }
-  // Draw wand in OSG
-  if( sharedTransforms.getSize() > WAND_SENSOR_IDX ){
-    wand_matrix = sharedTransforms.getValAt(WAND_SENSOR_IDX);
 
-    glm::vec3 wand_position = glm::vec3(wand_matrix*glm::vec4(0,0,0,1));
-    //glm::quat wand_orientation = glm::quat_cast(wand_matrix);
-    glm::mat3 wand_orientation = glm::mat3(wand_matrix);
-
-    glm::vec3 start = wand_position;
-    glm::vec3 end = wand_position + wand_orientation * glm::vec3(0,0,-10);
-    wand_start = osg::Vec3(start.x, start.y, start.z);
-    wand_end = osg::Vec3(end.x, end.y, end.z);
-
-    osg::Vec3Array* vertices = new osg::Vec3Array();
-    vertices->push_back(wand_start);
-    vertices->push_back(wand_end);
-    linesGeom->setVertexArray(vertices);
-    wandLine->setStart(wand_start);
-    wandLine->setEnd(wand_end);
+  osg::Vec3 start, end;
+  if( wand.sensor >= 0 ){
+    wand.matrix = sharedTransforms.getValAt(wand.sensor);
+    getWandRay( wand.matrix, start, end );
+  }
+  else if( idx < numUserWands ){
+    //keyboard controlled wand when there is no VRPN server
+    start = wand_start;
+    end = wand_end;
   }
   else {
-    //Debug drawing for wand even if there is no VRPN server
-    osg::Vec3Array* vertices = new osg::Vec3Array();
-    vertices->push_back(wand_start);
-    vertices->push_back(wand_end);
-    linesGeom->setVertexArray(vertices);
-    wandLine->setStart(wand_start);
-    wandLine->setEnd(wand_end);
+    //benchmark wands fan out around the first wand
+    float angle = 2.0f * osg::PI * (idx - numUserWands + 1) / (mWands.size() - numUserWands + 1);
+    osg::Vec3 dir = osg::Quat( angle, osg::Vec3(0, 1, 0) ) * (mWands[0].ray->getEnd() - mWands[0].ray->getStart());
+    start = mWands[0].ray->getStart();
+    end = start + dir;
   }
+  wand.ray->reset();
+  wand.ray->setStart(start);
+  wand.ray->setEnd(end);
+}
+
+void navigate(WandState & wand){
   //movement - only if we have a head to move ;)
-  if( sharedTransforms.getSize() > HEAD_SENSOR_IDX) {
-	if (!moving) {
+  if( wand.head < 0 ) return;
+
+	if (!wand.moving) {
 	  //store initial position of wand for deadzone calculation
-	  wand_startPos = glm::vec3(wand_matrix*glm::vec4(0, 0, 0, 1)); 
+	  wand.startPos = glm::vec3(wand.matrix*glm::vec4(0, 0, 0, 1)); 
 	}
 
-    wand_matrix = sharedTransforms.getValAt(WAND_SENSOR_IDX);
-    
-	glm::vec3 wand_position = glm::vec3(wand_matrix*glm::vec4(0,0,0,1));
-    glm::mat3 wand_orientation = glm::mat3(wand_matrix);
+	glm::vec3 wand_position = glm::vec3(wand.matrix*glm::vec4(0,0,0,1));
 
-    head_matrix = sharedTransforms.getValAt(HEAD_SENSOR_IDX);
+    glm::mat4 head_matrix = sharedTransforms.getValAt(wand.head);
     glm::vec3 head_position = glm::vec3(head_matrix*glm::vec4(0,0,0,1));
 	
-	//intial static speed factor
-	float speedFactor = 0.1*gEngine->getDt();
-	
 	//user sets speed, deadzone is 10 cm from original position
-	speedFactor = (	length(wand_startPos - wand_position) < 0.1 ? 0 : length(wand_startPos - wand_position)/50);
+	//the speed is per step so it no longer depends on the frame rate
+	float speedFactor = (	length(wand.startPos - wand_position) < 0.1 ? 0 : length(wand.startPos - wand_position)/50);
 	
 	//if we pull the control towards us it should go backwards
-	int direction = (	length(wand_startPos - head_position) > length(wand_position - head_position) ) ? -1 : 1;
+	int direction = (	length(wand.startPos - head_position) > length(wand_position - head_position) ) ? -1 : 1;
 	speedFactor *= direction;
     //Move the world in the opposite direction for the movement effect 
-	if(point) {
-		glm::vec3 translation = (glm::mat3(wand_matrix) * glm::vec3(0, 0, -1)*speedFactor);
-      mSceneTrans->postMult(osg::Matrix::translate(
+	if(wand.point) {
+		glm::vec3 translation = (glm::mat3(wand.matrix) * glm::vec3(0, 0, -1)*speedFactor);
+      mSimScene.postMult(osg::Matrix::translate(
 		  -osg::Vec3(translation.x, translation.y, translation.z)));
     }
-    else if (crosshair) {
+    else if (wand.crosshair) {
 		glm::vec3 translation = normalize(head_position - wand_position)*speedFactor;
-      mSceneTrans->postMult(osg::Matrix::translate(
+      mSimScene.postMult(osg::Matrix::translate(
 		  osg::Vec3(translation.x, translation.y, translation.z)));
     }
+}
+
+void simulationStep(){
+  for( size_t i = 0; i < mWands.size(); i++ ){
+    readWandInput( mWands[i], i );
+    //every user moves the world, their movements add up
+    navigate( mWands[i] );
   }
-	if (!selecting) {
-		// save wand matrix for manipulation
-		wand_startMat = wand_matrix;
-	}
-  //traverse if there are any tasks to do
-  if (!mViewer->done()){
-    mViewer->eventTraversal();
-    mViewer->updateTraversal();
-    calculateIntersections();
-  }
+
+  //pick against the pose of this step, not the interpolated pose that was drawn
+  mSceneTrans->setMatrix( mSimScene );
+  for( int i = 0; i < NUM_MODELS; i++ )
+    getModelTrans(i)->setMatrix( mSimModels[i] );
+  calculateIntersections();
+
+  for( size_t i = 0; i < mWands.size(); i++ )
+    manipulate( mWands[i], i );
 }
 
-void calculateIntersections() {
-  //visit all nodes and look for intersection
-  osgUtil::IntersectionVisitor visitor;
-  visitor.setIntersector(wandLine);
-  mRootNode->accept(visitor);
-
-  if(!intersectedNode && wandLine->containsIntersections()) {
-	//get intersection, store it and change the color of the object to a highlight yellow color
-	//we store it
-	osgUtil::LineSegmentIntersector::Intersection intersectionInfo = wandLine->getFirstIntersection();
-    osg::NodePath nodePath = intersectionInfo.nodePath;
-
-    intersecting = true;
-    for (osg::NodePath::iterator it = nodePath.begin() ; it != nodePath.end(); ++it) {
-      if((*it) == mCessnaModel || (*it) == mModel) {
-        intersectedNode = (*it);
+void intersectWands(size_t first, size_t stride) {
+  for( size_t i = first; i < mWands.size(); i += stride ) {
+    WandState & wand = mWands[i];
+
+    //visit all nodes and look for intersection
+    osgUtil::IntersectionVisitor visitor(wand.ray.get());
+    visitor.setTraversalMask(~HUD_NODE_MASK);
+    mRootNode->accept(visitor);
+
+    wand.hit = -1;
+    if(wand.ray->containsIntersections()) {
+      osg::NodePath nodePath = wand.ray->getFirstIntersection().nodePath;
+      for (osg::NodePath::iterator it = nodePath.begin() ; it != nodePath.end(); ++it) {
+        for( int j = 0; j < NUM_MODELS; j++ ) {
+          if(getModel(j) && (*it) == getModel(j)) {
+            wand.hit = j;
+          }
+        }
       }
     }
+  }
+}
 
-    osg::ref_ptr<osg::Material> mat = (osg::Material*)intersectedNode->getOrCreateStateSet()->getAttribute(osg::StateAttribute::MATERIAL);
+void calculateIntersections() {
+  double startTime = sgct::Engine::getTime();
 
-    if(!mat) {
-      mat = new osg::Material();
+  //bounds are computed lazily, update them here so the workers only read the scene graph
+  mRootNode->getBound();
+
+  //wake no more workers than there are wands, this thread takes the first share
+  {
+    std::lock_guard<std::mutex> lock( pickMutex );
+    pickStride = std::max<size_t>( 1, std::min( mWands.size(), mPickWorkers.size() + 1 ) );
+    pickNext = 1;
+    pickPending = pickStride - 1;
+  }
+  for( size_t t = 1; t < pickStride; t++ )
+    pickStart.notify_one();
+  intersectWands( 0, pickStride );
+
+  std::unique_lock<std::mutex> lock( pickMutex );
+  pickDone.wait( lock, []{ return pickPending == 0; } );
+
+  pickTime += sgct::Engine::getTime() - startTime;
+  pickSteps++;
+}
+
+void startPickWorkers() {
+  size_t threads = std::min<size_t>( MAX_WANDS, std::max(1u, std::thread::hardware_concurrency()) );
+  for( size_t t = 1; t < threads; t++ )
+    mPickWorkers.push_back( std::thread( pickWorker ) );
+}
+
+void stopPickWorkers() {
+  {
+    std::lock_guard<std::mutex> lock( pickMutex );
+    pickStop = true;
+  }
+  pickStart.notify_all();
+  for( size_t t = 0; t < mPickWorkers.size(); t++ )
+    mPickWorkers[t].join();
+  mPickWorkers.clear();
+}
+
+void pickWorker() {
+  while( true ) {
+    size_t first, stride;
+    {
+      //a worker that wakes without a share left goes back to sleep
+      std::unique_lock<std::mutex> lock( pickMutex );
+      pickStart.wait( lock, []{ return pickStop || pickNext < pickStride; } );
+      if( pickStop ) return;
+      first = pickNext++;
+      stride = pickStride;
     }
-    mat->setAmbient (osg::Material::FRONT_AND_BACK, osg::Vec4(1, 1, 0, 1.0));
-    mat->setDiffuse (osg::Material::FRONT_AND_BACK, osg::Vec4(1, 1, 0, 1.0));
-
-    intersectedNode->getOrCreateStateSet()->setAttributeAndModes(mat.get(), osg::StateAttribute::OVERRIDE);
-  }
-  else if(selecting && intersectedNode) {
-	//selection button pressed - make the object green and make it follow the wand
-    osg::ref_ptr<osg::Material> mat = (osg::Material*)intersectedNode->getOrCreateStateSet()->getAttribute(osg::StateAttribute::MATERIAL);
-    mat->setAmbient (osg::Material::FRONT_AND_BACK, osg::Vec4(0, 1, 0, 1.0));
-    mat->setDiffuse (osg::Material::FRONT_AND_BACK, osg::Vec4(0, 1, 0, 1.0));
-    intersectedNode->getOrCreateStateSet()->setAttributeAndModes(mat.get(), osg::StateAttribute::OVERRIDE);
-
-	//use the difference between the starting wand orientation and current position to determine the transformation
-    glm::mat4 diff = wand_startMat;
-    glm::mat4 diffInv = inverse(wand_matrix);
-
-	  osg::ref_ptr < osg::MatrixTransform > parent = intersectedNode->getParent(0)->asTransform()->asMatrixTransform();
-    if (scaling != 0) {
-	  
-		//Original scaling idea but sucks in the VR-lab due to lag
-		//glm::vec3 wand_start_position = glm::vec3(wand_startMat*glm::vec4(0, 0, 0, 1));
-		//glm::vec3 wand_position = glm::vec3(wand_matrix*glm::vec4(0, 0, 0, 1));
-		//glm::vec3 direction = wand_start_position - wand_position;
-		//float scale = 1 - (wand_start_position.z - wand_position.z);
-
-	  float scaleVal = 0.05;
-      float scale = 1-(scaleVal*scaling);
-      parent->preMult(osg::Matrix::scale( scale, scale, scale));
+
+    intersectWands( first, stride );
+
+    {
+      std::lock_guard<std::mutex> lock( pickMutex );
+      pickPending--;
     }
-    else {
-	    parent->postMult(osg::Matrix(glm::value_ptr(inverse(diff*diffInv))));
+    pickDone.notify_one();
+  }
+}
+
+void manipulate(WandState & wand, size_t idx) {
+  int self = static_cast<int>(idx);
+
+  //let go of the model when the selection button is released
+  if( wand.picked >= 0 && grabbedBy[wand.picked] == self && !wand.selecting )
+    grabbedBy[wand.picked] = -1;
+
+  if( wand.picked < 0 || grabbedBy[wand.picked] != self ) {
+    //point at whatever is under the ray, the first wand that selects a free model
+    //holds it until released, other users can only point at it meanwhile
+    wand.picked = wand.hit;
+    if( wand.selecting && wand.picked >= 0 && grabbedBy[wand.picked] < 0 ) {
+      grabbedBy[wand.picked] = self;
+      wand.startMat = wand.matrix;
     }
+    return;
+  }
+
+  //selection button pressed - the object turns green and follows the wand
+  //use the difference between the starting wand orientation and current position to determine the transformation
+  glm::mat4 diff = wand.startMat;
+  glm::mat4 diffInv = inverse(wand.matrix);
+
+  if (wand.scaling != 0) {
+
+	//Original scaling idea but sucks in the VR-lab due to lag
+	//glm::vec3 wand_start_position = glm::vec3(wand.startMat*glm::vec4(0, 0, 0, 1));
+	//glm::vec3 wand_position = glm::vec3(wand.matrix*glm::vec4(0, 0, 0, 1));
+	//glm::vec3 direction = wand_start_position - wand_position;
+	//float scale = 1 - (wand_start_position.z - wand_position.z);
 
-    wand_startMat = wand_matrix;
+    float scaleVal = 0.05;
+    float scale = 1-(scaleVal*wand.scaling);
+    mSimModels[wand.picked].preMult(osg::Matrix::scale( scale, scale, scale));
   }
-  else if(!wandLine->containsIntersections()) {
-    mModel->getOrCreateStateSet()->removeAttribute(osg::StateAttribute::MATERIAL);
-    mCessnaModel->getOrCreateStateSet()->removeAttribute(osg::StateAttribute::MATERIAL);
-    intersectedNode = NULL;
+  else {
+    mSimModels[wand.picked].postMult(osg::Matrix(glm::value_ptr(inverse(diff*diffInv))));
+  }
+
+  wand.startMat = wand.matrix;
+}
+
+void updateHighlight(const int * highlight) {
+  for( int i = 0; i < NUM_MODELS; i++ ) {
+    //models rejected by the memory budget are not in the scene
+    if( !getModel(i) ) continue;
+    osg::StateSet * state = getModel(i)->getOrCreateStateSet();
+
+    if( highlight[i] == HIGHLIGHT_NONE ) {
+      state->removeAttribute(osg::StateAttribute::MATERIAL);
+      continue;
+    }
+
+    //yellow when a wand points at the model, green while it is held
+    osg::Vec4 color = highlight[i] == HIGHLIGHT_HELD ? osg::Vec4(0, 1, 0, 1.0) : osg::Vec4(1, 1, 0, 1.0);
+    osg::ref_ptr<osg::Material> mat = (osg::Material*)state->getAttribute(osg::StateAttribute::MATERIAL);
+    if(!mat) {
+      mat = new osg::Material();
+    }
+    mat->setAmbient (osg::Material::FRONT_AND_BACK, color);
+    mat->setDiffuse (osg::Material::FRONT_AND_BACK, color);
+    state->setAttributeAndModes(mat.get(), osg::StateAttribute::OVERRIDE);
   }
-  wandLine->reset();
+}
+
+osg::Node * getModel(int idx) {
+  return idx == MODEL_IDX ? mModel.get() : mCessnaModel.get();
+}
+
+osg::MatrixTransform * getModelTrans(int idx) {
+  return idx == MODEL_IDX ? mModelTrans.get() : mCessnaTrans.get();
+}
+
+glm::mat4 toGlm(const osg::Matrix & m) {
+  return glm::mat4( glm::make_mat4( m.ptr() ) );
+}
+
+osg::Matrix interpolateMatrix(const glm::mat4 & from, const glm::mat4 & to, float t) {
+  osg::Vec3d fromPos, toPos, fromScale, toScale;
+  osg::Quat fromRot, toRot, so;
+  osg::Matrix( glm::value_ptr(from) ).decompose( fromPos, fromRot, fromScale, so );
+  osg::Matrix( glm::value_ptr(to) ).decompose( toPos, toRot, toScale, so );
+
+  osg::Quat rot;
+  rot.slerp( t, fromRot, toRot );
+  return osg::Matrix::scale( fromScale * (1.0f - t) + toScale * t ) *
+         osg::Matrix::rotate( rot ) *
+         osg::Matrix::translate( fromPos * (1.0f - t) + toPos * t );
 }
 
 void myDrawFun() {
+  double startTime = sgct::Engine::getTime();
+
   const int * curr_vp = gEngine->getCurrentViewportPixelCoords();
   mViewer->getCamera()->setViewport(curr_vp[0], curr_vp[1], curr_vp[2], curr_vp[3]);
-  mViewer->getCamera()->setProjectionMatrix( osg::Matrix( glm::value_ptr(gEngine->getCurrentViewProjectionMatrix() ) ));
+  osg::Matrix viewProjection( glm::value_ptr(gEngine->getCurrentViewProjectionMatrix() ) );
 
-  mViewer->renderingTraversals();
+  //the overlay covers the current viewport, text starts 100 pixels from the top
+  mHudCamera->setProjectionMatrixAsOrtho2D(0, curr_vp[2], 0, curr_vp[3]);
+  mHudText->setPosition( osg::Vec3(120.0f, curr_vp[3] - 100.0f, 0.0f) );
 
+  sgct_core::Frustum::FrustumMode eye = gEngine->getCurrentFrustumMode();
+  const void * viewport = gEngine->getCurrentWindowPtr()->getCurrentViewport();
+
+  if( sharedSinglePassStereo.getVal() && eye == sgct_core::Frustum::StereoRightEye &&
+      viewport == culledViewport && gEngine->getCurrentFrameNumber() == culledFrame ){
+    //the left eye already culled this viewport, only draw
+    mEyeProjection->set( viewProjection );
+    drawSharedEye();
+  }
+  else if( sharedSinglePassStereo.getVal() && eye == sgct_core::Frustum::StereoLeftEye ){
+    //cull once with a frustum wide enough for both eyes and draw the left eye with its own projection
+    mEyeProjection->set( viewProjection );
+    mViewer->getCamera()->setProjectionMatrix( viewProjection *
+      osg::Matrix::scale( 1.0f / (1.0f + getStereoCullMargin()), 1.0f, 1.0f ) );
+    shareEyeCull = true;
+    mViewer->renderingTraversals();
+    collectCullStats();
+
+    culledViewport = viewport;
+    culledFrame = gEngine->getCurrentFrameNumber();
+  }
+  else {
+    //mono, or the left eye was drawn for another viewport - cull and draw as usual
+    mViewer->getCamera()->setProjectionMatrix( viewProjection );
+    shareEyeCull = false;
+    mViewer->renderingTraversals();
+    collectCullStats();
+    culledViewport = NULL;
+  }
+
+  if( !sharedTextOverlay.getVal() ){
 	// draw text with OpenGL
 	float textVerticalPos = static_cast<float>(gEngine->getCurrentWindowPtr()->getYResolution()) - 100.0f;
-	int fontSize = 12;
 
 	glColor3f(1.0f, 1.0f, 1.0f);
-	sgct_text::print(sgct_text::FontManager::instance()->getFont( "SGCTFont", fontSize ),
+	sgct_text::print(sgct_text::FontManager::instance()->getFont( "SGCTFont", HUD_FONT_SIZE ),
 		120.0f, textVerticalPos,
 		sharedText.getVal().c_str() );
+  }
+
+  double elapsed = sgct::Engine::getTime() - startTime;
+  drawTime += elapsed;
+  stereoBenchTime[sharedStereoBench.getVal()] += elapsed;
+  textBenchTime[sharedTextBench.getVal()] += elapsed;
+}
+
+//the right eye sees a point at distance z shifted by P[0][0] * separation / z in
+//normalized device coordinates, the shift is largest for points on the near plane
+float getStereoCullMargin(){
+  float separation = sgct_core::ClusterManager::instance()->getDefaultUserPtr()->getEyeSeparation();
+  return gEngine->getCurrentProjectionMatrix()[0][0] * fabs(separation) / gEngine->getNearClippingPlane();
+}
+
+void drawSharedEye(){
+  osgViewer::Renderer * renderer = dynamic_cast<osgViewer::Renderer*>(mViewer->getCamera()->getRenderer());
+  osgUtil::SceneView * sceneView = renderer->getSceneView(0);
+
+  //allow the already drawn stages to be drawn again
+  osgUtil::RenderStage * stage = sceneView->getRenderStage();
+  stage->setStageDrawnThisFrame( false );
+  osgUtil::RenderStage::RenderStageList & postStages = stage->getPostRenderList();
+  for( osgUtil::RenderStage::RenderStageList::iterator it = postStages.begin(); it != postStages.end(); ++it )
+    it->second->setStageDrawnThisFrame( false );
+
+  sceneView->draw();
+  sharedEyeDraws++;
 }
 
 void myEncodeFun(){
   sgct::SharedData::instance()->writeDouble( &curr_time );
   sgct::SharedData::instance()->writeVector( &sharedTransforms );
+  sgct::SharedData::instance()->writeVector( &sharedWandSensors );
+  sgct::SharedData::instance()->writeObj( &sharedSimPrevious );
+  sgct::SharedData::instance()->writeObj( &sharedSimCurrent );
+  sgct::SharedData::instance()->writeFloat( &sharedSimAlpha );
 	sgct::SharedData::instance()->writeString( &sharedText );
+  sgct::SharedData::instance()->writeBool( &sharedSinglePassStereo );
+  sgct::SharedData::instance()->writeInt( &sharedStereoBench );
+  sgct::SharedData::instance()->writeBool( &sharedTextOverlay );
+  sgct::SharedData::instance()->writeInt( &sharedTextBench );
 }
 
 void myDecodeFun(){
   sgct::SharedData::instance()->readDouble( &curr_time );
   sgct::SharedData::instance()->readVector( &sharedTransforms );
+  sgct::SharedData::instance()->readVector( &sharedWandSensors );
+  sgct::SharedData::instance()->readObj( &sharedSimPrevious );
+  sgct::SharedData::instance()->readObj( &sharedSimCurrent );
+  sgct::SharedData::instance()->readFloat( &sharedSimAlpha );
 	sgct::SharedData::instance()->readString( &sharedText );
+  sgct::SharedData::instance()->readBool( &sharedSinglePassStereo );
+  sgct::SharedData::instance()->readInt( &sharedStereoBench );
+  sgct::SharedData::instance()->readBool( &sharedTextOverlay );
+  sgct::SharedData::instance()->readInt( &sharedTextBench );
 }
 
 void myCleanUpFun(){
+  stopPickWorkers();
   sgct::MessageHandler::instance()->print("Cleaning up osg data...\n");
   delete mViewer;
   mViewer = NULL;
@@ -454,16 +1094,62 @@ void keyCallback(int key, int action) {
     break;
 	//buttons for debugging selecting and scaling
   case SGCT_KEY_Y:
-    selecting = true;
+    mWands[0].selecting = true;
     break;
   case SGCT_KEY_U:
-    selecting = false;
+    mWands[0].selecting = false;
     break;
   case SGCT_KEY_H:
-    scaling = true;
+    mWands[0].scaling = true;
     break;
   case SGCT_KEY_J:
-    scaling = false;
+    mWands[0].scaling = false;
+    break;
+  //double the number of wands up to MAX_WANDS with benchmark wands, then start over
+  case SGCT_KEY_N:
+    if( action == SGCT_PRESS )
+      setBenchmarkWands( mWands.size() >= MAX_WANDS ? 0 : mWands.size() * 2 - numUserWands );
+    break;
+  //toggle single pass stereo to compare draw times
+  case SGCT_KEY_M:
+    if( action == SGCT_PRESS ){
+      sharedSinglePassStereo.setVal( !sharedSinglePassStereo.getVal() );
+      sgct::MessageHandler::instance()->print("Single pass stereo %s\n", sharedSinglePassStereo.getVal() ? "on" : "off");
+    }
+    break;
+  //run STEREO_BENCH_FRAMES frames single pass, then as many with one cull per eye
+  case SGCT_KEY_B:
+    if( action == SGCT_PRESS && sharedStereoBench.getVal() == 0 ){
+      stereoBenchFrames = 0;
+      stereoBenchSinglePass = sharedSinglePassStereo.getVal();
+      sharedStereoBench.setVal( 1 );
+      sharedSinglePassStereo.setVal( true );
+      sgct::MessageHandler::instance()->print("Stereo benchmark started\n");
+    }
+    break;
+  //toggle between the cached text overlay and sgct_text::print
+  case SGCT_KEY_T:
+    if( action == SGCT_PRESS ){
+      sharedTextOverlay.setVal( !sharedTextOverlay.getVal() );
+      sgct::MessageHandler::instance()->print("Text overlay %s\n", sharedTextOverlay.getVal() ? "on" : "off");
+    }
+    break;
+  //cycle 0, 10, 100 and 1000 extra text lines
+  case SGCT_KEY_L:
+    if( action == SGCT_PRESS ){
+      benchmarkLines = benchmarkLines == 0 ? 10 : benchmarkLines >= 1000 ? 0 : benchmarkLines * 10;
+      sgct::MessageHandler::instance()->print("Benchmark text lines: %d\n", benchmarkLines);
+    }
+    break;
+  //run TEXT_BENCH_FRAMES frames with each text path at 10, 100 and 1000 extra lines
+  case SGCT_KEY_O:
+    if( action == SGCT_PRESS && sharedTextBench.getVal() == 0 ){
+      textBenchFrames = 0;
+      textBenchLines = benchmarkLines;
+      textBenchOverlay = sharedTextOverlay.getVal();
+      setTextBenchPhase( 1 );
+      sgct::MessageHandler::instance()->print("Text benchmark started\n");
+    }
     break;
   }
 
@@ -491,8 +1177,6 @@ void initOSG(){
 
   mViewer->getCamera()->setGraphicsContext(graphicsWindow.get());
 
-  wandLine = new osgUtil::LineSegmentIntersector(wand_start, wand_end);
-
   //SGCT will handle the near and far planes
   mViewer->getCamera()->setComputeNearFarMode(osgUtil::CullVisitor::DO_NOT_COMPUTE_NEAR_FAR);
   mViewer->getCamera()->setClearColor( osg::Vec4( 0.0f, 0.0f, 0.0f, 0.0f) );
@@ -501,10 +1185,10 @@ void initOSG(){
   GLbitfield tmpMask = mViewer->getCamera()->getClearMask();
   mViewer->getCamera()->setClearMask(tmpMask & (~(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT)));
 
-  wandLine->setStart(wand_start);
-  wandLine->setEnd(wand_end);
-
   mViewer->setSceneData(mRootNode.get());
+
+  mEyeProjection = new osg::RefMatrix();
+  mViewer->getCamera()->setPreDrawCallback( new EyeProjectionCallback() );
 }
 
 osg::Geode* createWand(){
@@ -532,13 +1216,106 @@ osg::Geode* createWand(){
   return geode;
 }
 
-void createOSGScene(){
+osg::OcclusionQueryNode* createOcclusionNode(osg::Node* child){
 
-  mRootNode->addChild(createWand());
+  osg::OcclusionQueryNode* occlusion = new osg::OcclusionQueryNode();
+  occlusion->setVisibilityThreshold( OCCLUSION_PIXELS );
+  //reuse the last result for a few frames, objects rarely pop in between
+  occlusion->setQueryFrameCount( OCCLUSION_FRAMES );
+  occlusion->setDebugDisplay( false );
+  occlusion->addChild( child );
+  mOcclusionNodes.push_back( occlusion );
+
+  return occlusion;
+}
+
+//reads a model and attaches it centered and scaled to size, NULL if it could not be read or is over budget
+osg::Node * loadModel(const std::string & file, osg::MatrixTransform * trans, float offsetX, double size){
+  //models that do not fit in the memory budget of this node are left out,
+  //first by their file size before reading and then by their loaded size
+  if( !checkFileBudget(file, MODEL_MEMORY_BUDGET_MB) )
+    return NULL;
+
+  sgct::MessageHandler::instance()->print("Loading model %s...\n", file.c_str());
+  osg::ref_ptr<osg::Node> model = osgDB::readNodeFile(file);
+  if( !model.valid() ){
+    sgct::MessageHandler::instance()->print("Failed to read model %s!\n", file.c_str());
+    return NULL;
+  }
+
+  if( !checkMemoryBudget(file, model.get(), MODEL_MEMORY_BUDGET_MB) )
+    return NULL;
+
+  trans->addChild(model.get());
+  setMemoryBudget(file, model.get(), MODEL_MEMORY_BUDGET_MB);
+
+  //get the bounding box
+  osg::ComputeBoundsVisitor cbv;
+  osg::BoundingBox &bb(cbv.getBoundingBox());
+  model->accept( cbv );
+
+  osg::Vec3f tmpVec;
+  tmpVec = bb.center();
+  tmpVec.x() += offsetX;
+
+  // translate model center to origin
+  trans->postMult(osg::Matrix::translate( -tmpVec ) );
+
+  // scale model to a manageable size
+  double scale = size / bb.radius();
+  trans->postMult(osg::Matrix::scale( scale, scale, scale ));
 
-  osg::ref_ptr<osg::MatrixTransform> mModelTrans;
-  osg::ref_ptr<osg::MatrixTransform> mCessnaTrans;
+  sgct::MessageHandler::instance()->print("%s bounding sphere center:\tx=%f\ty=%f\tz=%f\n", file.c_str(), tmpVec[0], tmpVec[1], tmpVec[2] );
+  sgct::MessageHandler::instance()->print("%s bounding sphere radius:\t%f\n", file.c_str(), bb.radius() );
 
+  //disable face culling
+  model->getOrCreateStateSet()->setMode( GL_CULL_FACE,
+                                         osg::StateAttribute::OFF | osg::StateAttribute::OVERRIDE);
+  return model.get();
+}
+
+void createTextOverlay(){
+  mHudCamera = new osg::Camera();
+  mHudCamera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+  mHudCamera->setViewMatrix(osg::Matrix::identity());
+  mHudCamera->setRenderOrder(osg::Camera::POST_RENDER);
+  mHudCamera->setClearMask(0);
+  mHudCamera->setAllowEventFocus(false);
+  mHudCamera->setNodeMask(HUD_NODE_MASK);
+
+  osg::StateSet * state = mHudCamera->getOrCreateStateSet();
+  state->setMode(GL_LIGHTING, osg::StateAttribute::OFF | osg::StateAttribute::PROTECTED);
+  state->setMode(GL_DEPTH_TEST, osg::StateAttribute::OFF);
+
+  //osgText keeps the glyphs in a texture atlas and the laid out quads in one
+  //vertex array, it is only rebuilt when setText is called with a new string
+  mHudText = new osgText::Text();
+  mHudText->setDataVariance(osg::Object::DYNAMIC);
+  mHudText->setCharacterSize(HUD_FONT_SIZE);
+  mHudText->setAlignment(osgText::Text::LEFT_TOP);
+  mHudText->setColor(osg::Vec4(1.0f, 1.0f, 1.0f, 1.0f));
+
+  osg::Geode * geode = new osg::Geode();
+  geode->addDrawable(mHudText.get());
+  mHudCamera->addChild(geode);
+
+  mRootNode->addChild(mHudCamera.get());
+}
+
+void updateTextOverlay(){
+  mHudCamera->setNodeMask( sharedTextOverlay.getVal() ? HUD_NODE_MASK : 0 );
+
+  //the tracker dump rarely changes when nobody moves, skip the layout then
+  if( sharedTextOverlay.getVal() && sharedText.getVal() != hudString ){
+    hudString = sharedText.getVal();
+    mHudText->setText(hudString);
+  }
+}
+
+void createOSGScene(){
+
+  mRootNode->addChild(createWand());
+  createTextOverlay();
 
   mSceneTrans		= new osg::MatrixTransform();
   mModelTrans		= new osg::MatrixTransform();
@@ -550,64 +1327,155 @@ void createOSGScene(){
 
   mCessnaTrans->preMult(osg::Matrix::rotate(glm::radians(-90.0f),
                                            1.0f, 0.0f, 0.0f));
-  mRootNode->addChild( mSceneTrans.get() );
-  mSceneTrans->addChild( mModelTrans.get() );
-  mSceneTrans->addChild( mCessnaTrans.get() );
-
-  sgct::MessageHandler::instance()->print("Loading model airplane.ive'...\n");
-  sgct::MessageHandler::instance()->print("and cessna.org'...\n");
-  mModel = osgDB::readNodeFile("airplane.ive");
-  mCessnaModel = osgDB::readNodeFile("cessna.osg");
-
-  if ( mModel.valid() && mCessnaModel.valid()){
-    sgct::MessageHandler::instance()->print("Models loaded successfully!\n");
-
-    mModelTrans->addChild(mModel.get());
-    mCessnaTrans->addChild(mCessnaModel.get());
-
-    //get the bounding box
-    osg::ComputeBoundsVisitor cbv;
-    osg::BoundingBox &bb(cbv.getBoundingBox());
-    mModel->accept( cbv );
+  // occlusion queries are nested so a hidden scene skips the per model queries
+  mRootNode->addChild( createOcclusionNode( mSceneTrans.get() ) );
+  mSceneTrans->addChild( createOcclusionNode( mModelTrans.get() ) );
+  mSceneTrans->addChild( createOcclusionNode( mCessnaTrans.get() ) );
+
+  // count the models that reach the draw stage
+  mCullCounters.push_back( new CullCounter() );
+  mModelTrans->addCullCallback( mCullCounters.back().get() );
+  mCullCounters.push_back( new CullCounter() );
+  mCessnaTrans->addCullCallback( mCullCounters.back().get() );
+
+  //each model is attached before the next one is checked, so the scene budget covers both
+  mModel = loadModel("airplane.ive", mModelTrans.get(), 20.0f, 0.2);
+  mCessnaModel = loadModel("cessna.osg", mCessnaTrans.get(), -20.0f, 0.1);
+
+  setMemoryBudget("scene", mRootNode.get(), SCENE_MEMORY_BUDGET_MB);
+}
 
-    osg::Vec3f tmpVec;
-    tmpVec = bb.center();
-    tmpVec.x() += 20;
+void setupCulling(){
+  //cull against the frustum of the current viewport, near and far included since
+  //sgct provides them, and skip objects that cover only a few pixels
+  mViewer->getCamera()->setCullingMode( osg::CullSettings::VIEW_FRUSTUM_CULLING |
+                                        osg::CullSettings::SMALL_FEATURE_CULLING );
+  mViewer->getCamera()->setSmallFeatureCullingPixelSize( SMALL_FEATURE_PIXELS );
+
+  //occlusion results are stored per osg camera and all viewports share the same
+  //camera, so the queries are only valid on nodes with a single viewport
+  size_t numViewports = 0;
+  for( size_t i = 0; i < gEngine->getNumberOfWindows(); i++ )
+    numViewports += gEngine->getWindowPtr(i)->getNumberOfViewports();
+
+  bool useOcclusion = (numViewports == 1);
+  for( size_t i = 0; i < mOcclusionNodes.size(); i++ )
+    mOcclusionNodes[i]->setQueriesEnabled( useOcclusion );
+
+  sgct::MessageHandler::instance()->print("Culling: small feature %.1f px, occlusion queries %s\n",
+                                          SMALL_FEATURE_PIXELS, useOcclusion ? "on" : "off");
+}
 
-    // translate model center to origin
-    mModelTrans->postMult(osg::Matrix::translate( -tmpVec ) );
+void collectCullStats(){
+  cullTraversals++;
 
-    // scale model to a manageable size
-    double scale = 0.2 / bb.radius();
-    mModelTrans->postMult(osg::Matrix::scale( scale, scale, scale ));
+  osgViewer::Renderer * renderer = dynamic_cast<osgViewer::Renderer*>(mViewer->getCamera()->getRenderer());
+  osgUtil::Statistics stats;
+  if( renderer && renderer->getSceneView(0)->getStats(stats) )
+    drawnDrawables += stats.numDrawables;
+}
 
-    sgct::MessageHandler::instance()->print("airplane bounding sphere center:\tx=%f\ty=%f\tz=%f\n", tmpVec[0], tmpVec[1], tmpVec[2] );
-    sgct::MessageHandler::instance()->print("airplane bounding sphere radius:\t%f\n", bb.radius() );
+//counts the frames of each benchmark mode and reports on every node once the benchmark is over
+void updateStereoBenchmark(){
+  int phase = sharedStereoBench.getVal();
+  if( phase > 0 )
+    stereoBenchCount[phase]++;
+
+  if( phase == 0 && lastStereoBenchPhase != 0 && stereoBenchCount[1] > 0 && stereoBenchCount[2] > 0 ){
+    double singlePass = stereoBenchTime[1] * 1000.0 / stereoBenchCount[1];
+    double perEye = stereoBenchTime[2] * 1000.0 / stereoBenchCount[2];
+    sgct::MessageHandler::instance()->print("Node %d stereo benchmark: %.3f ms per frame single pass, %.3f ms with one cull per eye (%.0f%%)\n",
+                                            sgct_core::ClusterManager::instance()->getThisNodeId(),
+                                            singlePass, perEye, 100.0 * singlePass / perEye);
+  }
+  if( phase == 0 ){
+    for( int i = 0; i < 3; i++ ){
+      stereoBenchTime[i] = 0.0;
+      stereoBenchCount[i] = 0;
+    }
+  }
+  lastStereoBenchPhase = phase;
+}
 
-    //same as above for the cessna
-    mCessnaModel->accept( cbv );
+//odd phases draw the cached overlay and even phases sgct_text::print, phase 0
+//puts back the line count and text path from before the benchmark
+void setTextBenchPhase(int phase){
+  sharedTextBench.setVal( phase );
+  if( phase == 0 ){
+    benchmarkLines = textBenchLines;
+    sharedTextOverlay.setVal( textBenchOverlay );
+    return;
+  }
 
-    tmpVec = bb.center();
-    tmpVec.x() -= 20;
-    // translate model center to origin
-    mCessnaTrans->postMult(osg::Matrix::translate( -tmpVec ) );
+  benchmarkLines = 1;
+  for( int i = 0; i <= (phase - 1) / 2; i++ )
+    benchmarkLines *= 10;
+  sharedTextOverlay.setVal( phase % 2 == 1 );
+}
 
-    // scale model to a manageable size
-    scale = 0.1 / bb.radius();
-    mCessnaTrans->postMult(osg::Matrix::scale( scale, scale, scale ));
+//counts the frames of each text benchmark phase and reports on every node once it is over
+void updateTextBenchmark(){
+  int phase = sharedTextBench.getVal();
+  if( phase > 0 )
+    textBenchCount[phase]++;
+
+  if( phase == 0 && lastTextBenchPhase != 0 ){
+    int lines = 1;
+    for( int step = 0; step < TEXT_BENCH_STEPS; step++ ){
+      lines *= 10;
+      int overlayPhase = step * 2 + 1;
+      int printPhase = step * 2 + 2;
+      if( textBenchCount[overlayPhase] == 0 || textBenchCount[printPhase] == 0 ) continue;
+
+      double overlayTime = textBenchTime[overlayPhase] * 1000.0 / textBenchCount[overlayPhase];
+      double printTime = textBenchTime[printPhase] * 1000.0 / textBenchCount[printPhase];
+      sgct::MessageHandler::instance()->print("Node %d text benchmark, %d lines: %.3f ms per frame with the overlay, %.3f ms with sgct_text::print (%.0f%%)\n",
+                                              sgct_core::ClusterManager::instance()->getThisNodeId(),
+                                              lines, overlayTime, printTime, 100.0 * overlayTime / printTime);
+    }
+  }
+  if( phase == 0 ){
+    for( int i = 0; i < TEXT_BENCH_STEPS * 2 + 1; i++ ){
+      textBenchTime[i] = 0.0;
+      textBenchCount[i] = 0;
+    }
+  }
+  lastTextBenchPhase = phase;
+}
 
+void printCullStats(){
+  if( cullTraversals == 0 ) return;
 
-	sgct::MessageHandler::instance()->print("cessna bounding sphere center:\tx=%f\ty=%f\tz=%f\n", tmpVec[0], tmpVec[1], tmpVec[2]);
-	sgct::MessageHandler::instance()->print("cessna bounding sphere radius:\t%f\n", bb.radius());
-    //disable face culling
-    mCessnaModel->getOrCreateStateSet()->setMode( GL_CULL_FACE,
-                                            osg::StateAttribute::OFF | osg::StateAttribute::OVERRIDE);
-    mModel->getOrCreateStateSet()->setMode( GL_CULL_FACE,
-                                            osg::StateAttribute::OFF | osg::StateAttribute::OVERRIDE);
+  unsigned int drawn = 0;
+  for( size_t i = 0; i < mCullCounters.size(); i++ ){
+    drawn += mCullCounters[i]->drawn;
+    mCullCounters[i]->drawn = 0;
+  }
+  unsigned int tested = cullTraversals * mCullCounters.size();
+
+  //averages per viewport and eye so nodes with different setups can be compared
+  sgct::MessageHandler::instance()->print("Node %d culling: %.1f models drawn, %.1f culled, %.1f drawables per traversal\n",
+                                          sgct_core::ClusterManager::instance()->getThisNodeId(),
+                                          static_cast<float>(drawn) / cullTraversals,
+                                          static_cast<float>(tested - drawn) / cullTraversals,
+                                          static_cast<float>(drawnDrawables) / cullTraversals);
+  sgct::MessageHandler::instance()->print("Node %d drawing: %.3f ms per frame, %u cull traversals, %u eyes drawn without cull\n",
+                                          sgct_core::ClusterManager::instance()->getThisNodeId(),
+                                          drawTime * 1000.0 / STATS_INTERVAL,
+                                          cullTraversals, sharedEyeDraws);
+  cullTraversals = 0;
+  drawnDrawables = 0;
+  sharedEyeDraws = 0;
+  drawTime = 0.0;
+
+  //picking runs only on the master
+  if( pickSteps > 0 ){
+    sgct::MessageHandler::instance()->print("Picking: %u wands, %.3f ms per simulation step\n",
+                                            static_cast<unsigned int>(mWands.size()),
+                                            pickTime * 1000.0 / pickSteps);
+    pickTime = 0.0;
+    pickSteps = 0;
   }
-  else
-    sgct::MessageHandler::instance()->print("Failed to read model!\n");
-
 }
 
 void setupLightSource(){
@@ -642,3 +1510,86 @@ void setupLightSource(){
   mRootNode->addChild( lightSource1 );
 }
 
+//true if size fits in the model budget and in what is left of the scene budget
+bool fitsMemoryBudget(const std::string & name, double size, double megabytes){
+  double scene = toMegabytes( getMemoryUsage( mRootNode.get() ).cpuBytes() );
+  if( size > megabytes || scene + size > SCENE_MEMORY_BUDGET_MB ){
+    sgct::MessageHandler::instance()->print("%s rejected by budget: %.1f MB, %.1f MB model budget, %.1f of %.1f MB scene budget used\n",
+                                            name.c_str(), size, megabytes, scene, SCENE_MEMORY_BUDGET_MB);
+    return false;
+  }
+  return true;
+}
+
+//estimate from the file size before the model is read, a lower bound for binary formats
+//that grow when loaded, files that are not found pass and are reported by the reader
+bool checkFileBudget(const std::string & file, double megabytes){
+  std::string path = osgDB::findDataFile( file );
+  std::ifstream in( path.c_str(), std::ios::binary | std::ios::ate );
+  if( path.empty() || !in ) return true;
+
+  double size = toMegabytes( static_cast<size_t>( in.tellg() ) );
+  sgct::MessageHandler::instance()->print("%s: %.1f MB on disk\n", file.c_str(), size);
+  return fitsMemoryBudget( file, size, megabytes );
+}
+
+//exact check of a loaded model
+bool checkMemoryBudget(const std::string & name, osg::Node * node, double megabytes){
+  MemoryUsage usage = getMemoryUsage( node );
+  double size = toMegabytes( usage.cpuBytes() );
+
+  sgct::MessageHandler::instance()->print("%s: %.1f MB - %.1f MB geometry, %.1f MB textures in %u images\n",
+                                          name.c_str(), size,
+                                          toMegabytes( usage.geometryBytes ),
+                                          toMegabytes( usage.textureBytes ), usage.textures);
+  return fitsMemoryBudget( name, size, megabytes );
+}
+
+void setMemoryBudget(const std::string & name, osg::Node * node, double megabytes){
+  MemoryBudget budget;
+  budget.name = name;
+  budget.node = node;
+  budget.megabytes = megabytes;
+  mMemoryBudgets.push_back( budget );
+}
+
+void printMemoryStats(){
+  int nodeId = sgct_core::ClusterManager::instance()->getThisNodeId();
+
+  MemoryUsage scene = getMemoryUsage( mRootNode.get() );
+  sgct::MessageHandler::instance()->print("Node %d memory: %.1f MB - %u nodes %.1f MB, %u geometries %.1f MB, %u textures %.1f MB, %u state sets %.1f MB\n",
+                                          nodeId, toMegabytes( scene.cpuBytes() ),
+                                          scene.nodes, toMegabytes( scene.nodeBytes ),
+                                          scene.geometries, toMegabytes( scene.geometryBytes ),
+                                          scene.textures, toMegabytes( scene.textureBytes ),
+                                          scene.stateSets, toMegabytes( scene.stateSetBytes ));
+
+  double total = toMegabytes( scene.cpuBytes() );
+  osgViewer::ViewerBase::Contexts contexts;
+  mViewer->getContexts( contexts );
+  for( size_t i = 0; i < contexts.size(); i++ ){
+    unsigned int contextID = contexts[i]->getState()->getContextID();
+    MemoryUsage gpu = getMemoryUsage( mRootNode.get(), contextID );
+    double gpuSize = toMegabytes( gpu.gpuBytes() );
+    sgct::MessageHandler::instance()->print("Node %d context %u: %.1f MB buffers and display lists, %.1f MB textures%s\n",
+                                            nodeId, contextID,
+                                            toMegabytes( gpu.gpuBufferBytes ),
+                                            toMegabytes( gpu.gpuTextureBytes ),
+                                            gpuSize > GPU_MEMORY_BUDGET_MB ? " - over budget" : "");
+    total += gpuSize;
+  }
+
+  for( size_t i = 0; i < mMemoryBudgets.size(); i++ ){
+    const MemoryBudget & budget = mMemoryBudgets[i];
+    double size = toMegabytes( getMemoryUsage( budget.node.get() ).cpuBytes() );
+    if( size > budget.megabytes )
+      sgct::MessageHandler::instance()->print("Node %d %s: %.1f MB is over the %.1f MB budget\n",
+                                              nodeId, budget.name.c_str(), size, budget.megabytes);
+  }
+
+  //a total that keeps growing while the scene stays the same points at a leak
+  if( lastMemoryTotal > 0.0 )
+    sgct::MessageHandler::instance()->print("Node %d memory total: %.1f MB, %+.1f MB since the last report\n",
+                                            nodeId, total, total - lastMemoryTotal);
+  lastMemoryTotal = total;
+}